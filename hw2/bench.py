@@ -0,0 +1,186 @@
+import argparse
+import csv
+import os
+import random
+import shutil
+import subprocess
+import tempfile
+import time
+
+# --- CONFIGURATION ---
+DEFAULT_EXECUTABLE = "./hw2"
+DEFAULT_COUNTERS = 10
+CSV_FIELDS = ["threads", "trial", "jobs", "ops", "run_ms", "jobs_per_sec", "ops_per_sec",
+              "avg_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms", "wall_ms"]
+
+# --- WORKLOAD GENERATION ---
+
+def parse_mix(text):
+    """'inc:3,dec:1,sleep:1' -> [('inc', 3), ('dec', 1), ('sleep', 1)]"""
+    mix = []
+    for part in text.split(","):
+        name, weight = part.split(":")
+        if name not in ("inc", "dec", "sleep"):
+            raise ValueError(f"unknown op '{name}' in --mix")
+        mix.append((name, float(weight)))
+    return mix
+
+def make_sleep(dist, rng):
+    """none | const:MS | uniform:A-B | exp:MEAN -> milliseconds"""
+    if dist == "none":
+        return 0
+    kind, arg = dist.split(":")
+    if kind == "const":
+        return int(arg)
+    if kind == "uniform":
+        lo, hi = arg.split("-")
+        return rng.randint(int(lo), int(hi))
+    if kind == "exp":
+        return int(rng.expovariate(1.0 / float(arg)))
+    raise ValueError(f"bad --sleep '{dist}'")
+
+def expanded_ops(tokens):
+    """Number of ops a worker line really runs: every repeat multiplies the rest of the line."""
+    total = 0
+    multiplier = 1
+    for tok in tokens:
+        if tok.startswith("repeat"):
+            multiplier *= int(tok.split()[1])
+        else:
+            total += multiplier
+    return total
+
+def generate_cmdfile(path, args, rng):
+    """Writes a cmdfile and returns (jobs, ops) it contains."""
+    mix = parse_mix(args.mix)
+    names = [m[0] for m in mix]
+    weights = [m[1] for m in mix]
+    # Zipf-like popularity: counter k is picked with weight 1/(k+1)^skew
+    counter_weights = [1.0 / (k + 1) ** args.skew for k in range(args.counters)]
+
+    jobs = 0
+    ops = 0
+    with open(path, "w") as f:
+        for n in range(args.jobs):
+            tokens = []
+            for _ in range(args.ops_per_job):
+                op = rng.choices(names, weights)[0]
+                if op == "sleep":
+                    tokens.append(f"msleep {make_sleep(args.sleep, rng)}")
+                else:
+                    counter = rng.choices(range(args.counters), counter_weights)[0]
+                    tokens.append(f"{'increment' if op == 'inc' else 'decrement'} {counter}")
+            # Nested repeats, each one covering the rest of the line
+            for depth in range(args.repeat_depth):
+                pos = rng.randint(0, len(tokens) - 1)
+                tokens.insert(pos, f"repeat {args.repeat_count}")
+            f.write("worker " + "; ".join(tokens) + "\n")
+            jobs += 1
+            ops += expanded_ops(tokens)
+            if args.wait_every and (n + 1) % args.wait_every == 0:
+                f.write("dispatcher_wait\n")
+    return jobs, ops
+
+# --- RUNNING ---
+
+def read_stats(path):
+    stats = {}
+    with open(path) as f:
+        for line in f:
+            key, _, value = line.partition(":")
+            parts = value.split()
+            if parts:
+                try:
+                    stats[key.strip()] = float(parts[0])
+                except ValueError:
+                    pass
+    return stats
+
+def run_once(exe, cmdfile, threads, counters, extra_args, workdir, timeout):
+    start = time.monotonic()
+    subprocess.run([exe, cmdfile, str(threads), str(counters), "0"] + extra_args,
+                   cwd=workdir, check=True, timeout=timeout,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    wall_ms = (time.monotonic() - start) * 1000
+    return read_stats(os.path.join(workdir, "stats.txt")), wall_ms
+
+def thread_counts(spec):
+    """'1,2,8' or default: powers of two up to the core count, plus the core count."""
+    if spec:
+        return [int(t) for t in spec.split(",")]
+    cores = os.cpu_count() or 1
+    counts = []
+    t = 1
+    while t < cores:
+        counts.append(t)
+        t *= 2
+    counts.append(cores)
+    return counts
+
+def main():
+    parser = argparse.ArgumentParser(description="hw2 throughput/latency scaling benchmark")
+    parser.add_argument("--exe", default=DEFAULT_EXECUTABLE)
+    parser.add_argument("--out", default="bench.csv")
+    parser.add_argument("--jobs", type=int, default=2000)
+    parser.add_argument("--ops-per-job", type=int, default=4)
+    parser.add_argument("--mix", default="inc:3,dec:1,sleep:0")
+    parser.add_argument("--repeat-depth", type=int, default=0)
+    parser.add_argument("--repeat-count", type=int, default=3)
+    parser.add_argument("--skew", type=float, default=0.0, help="0 = uniform counters, higher = hotter counter 0")
+    parser.add_argument("--sleep", default="none", help="none, const:MS, uniform:A-B or exp:MEAN")
+    parser.add_argument("--counters", type=int, default=DEFAULT_COUNTERS)
+    parser.add_argument("--wait-every", type=int, default=0, help="dispatcher_wait after every N jobs")
+    parser.add_argument("--threads", default="", help="comma separated list, default 1..core count")
+    parser.add_argument("--trials", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=int, default=600)
+    parser.add_argument("--hw2-args", default="", help="extra hw2 options, e.g. '--stack-kb=32'")
+    args = parser.parse_args()
+    if args.repeat_depth > 0 and args.ops_per_job < 1:
+        parser.error("--repeat-depth needs --ops-per-job of at least 1")
+
+    exe = os.path.abspath(args.exe)
+    if not os.path.exists(exe):
+        print(f"Error: Executable {exe} not found. Did you run 'make'?")
+        return 1
+
+    workdir = tempfile.mkdtemp(prefix="hw2bench_")
+    try:
+        cmdfile = os.path.join(workdir, "cmdfile.txt")
+        jobs, ops = generate_cmdfile(cmdfile, args, random.Random(args.seed))
+        print(f"workload: {jobs} jobs, {ops} ops, mix {args.mix}, skew {args.skew}, sleep {args.sleep}")
+
+        with open(args.out, "w", newline="") as out:
+            writer = csv.DictWriter(out, fieldnames=CSV_FIELDS)
+            writer.writeheader()
+            for threads in thread_counts(args.threads):
+                for trial in range(args.trials):
+                    stats, wall_ms = run_once(exe, cmdfile, threads, args.counters,
+                                              args.hw2_args.split(), workdir, args.timeout)
+                    run_ms = max(stats.get("total running time", 0.0), 1.0)
+                    row = {
+                        "threads": threads,
+                        "trial": trial,
+                        "jobs": jobs,
+                        "ops": ops,
+                        "run_ms": run_ms,
+                        "jobs_per_sec": round(jobs * 1000.0 / run_ms, 1),
+                        "ops_per_sec": round(ops * 1000.0 / run_ms, 1),
+                        "avg_ms": stats.get("average job turnaround time", 0.0),
+                        "p50_ms": stats.get("p50 job turnaround time", 0.0),
+                        "p90_ms": stats.get("p90 job turnaround time", 0.0),
+                        "p99_ms": stats.get("p99 job turnaround time", 0.0),
+                        "max_ms": stats.get("max job turnaround time", 0.0),
+                        "wall_ms": round(wall_ms, 1),
+                    }
+                    writer.writerow(row)
+                    out.flush()
+                    print(f"threads={threads:<5} trial={trial} jobs/sec={row['jobs_per_sec']:<10} "
+                          f"ops/sec={row['ops_per_sec']:<10} p99={row['p99_ms']} ms")
+        print(f"results written to {args.out}")
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+    return 0
+
+if __name__ == "__main__":
+    raise SystemExit(main())
@@ -8,6 +8,8 @@ import random
 EXECUTABLE = "./hw2"
 DEFAULT_THREADS = 4
 DEFAULT_COUNTERS = 10
+# Extra hw2 options, e.g. HW2_ARGS="--virtual-time" to skip the real sleeps
+EXTRA_ARGS = os.environ.get("HW2_ARGS", "").split()
 
 def clean_files():
     """Removes old txt files to ensure fresh tests."""
@@ -39,7 +41,7 @@ def check_stats_file():
 def run_executable(num_threads=DEFAULT_THREADS, num_counters=DEFAULT_COUNTERS, log_mode=1, timeout=10):
     try:
         subprocess.run(
-            [EXECUTABLE, "cmdfile.txt", str(num_threads), str(num_counters), str(log_mode)],
+            [EXECUTABLE, "cmdfile.txt", str(num_threads), str(num_counters), str(log_mode)] + EXTRA_ARGS,
             check=True, 
             timeout=timeout,
             stdout=subprocess.DEVNULL, # Keep terminal clean
@@ -1,4 +1,5 @@
 #define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE           // sched_getcpu(), pthread_setaffinity_np()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,19 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define MAX_THREADS 4096
 #define MAX_COUNTERS 100
@@ -17,6 +31,31 @@
 #define LOG_ENABLE 1
 #define LOG_DISABLE 0
 #define COUNTER_FILE_NAME 64  // Increased size to prevent compiler warnings
+#define MAX_JOB_OPS (MAX_LINE_LENGTH / 2) // Every op needs at least one char and a ';'
+#define DEFAULT_STACK_KB 64   // Jobs run a flat op loop, they never need the 8 MB default
+#define MAX_STACK_KB (1 << 20) // 1 GB, keeps stack_kb * 1024 far from overflowing
+#define WORKERS_PER_SPAWNER 64
+
+// Lock ids for --lock-profile
+#define LOCK_QUEUE 0
+#define LOCK_STATS 1
+#define LOCK_FILE_BASE 2
+#define NUM_PROFILED_LOCKS (LOCK_FILE_BASE + MAX_COUNTERS)
+
+// Turnaround histogram: exact below 4 ms, then 4 buckets per power of two
+#define LAT_EXACT 4
+#define LAT_MAX_EXP 40
+#define LAT_BUCKETS (LAT_MAX_EXP * 4)
+#define METRICS_FILE "metrics.txt"
+
+// cmdfile scanner: read() block size, plus slack so SIMD loads past a
+// line's end stay inside the allocation
+#define SCAN_BUFFER_SIZE (1 << 20)
+#define SCAN_PADDING 64
+
+// --wait=spin: idle workers spin up to this many pause loops before parking
+#define DEFAULT_SPIN_MAX 4096
+#define SPIN_MIN 16
 
 // --- 1. STRUCTS MOVED TO TOP (Fixes "unknown type name" error) ---
 typedef struct job_t {
@@ -31,6 +70,67 @@ typedef struct job_queue_t {
     int size;
 } job_queue;
 
+// One decoded command of a worker line
+typedef enum { OP_MSLEEP, OP_INCREMENT, OP_DECREMENT, OP_REPEAT } op_kind;
+
+typedef struct job_op_t {
+    op_kind kind;
+    int arg;
+    int left;   // repeat only: iterations still to run
+    int outer;  // repeat only: index of the enclosing repeat, -1 if none
+} job_op;
+
+// Per-worker bookkeeping, filled while the pool is created
+typedef struct worker_info_t {
+    int created;          // pthread_create succeeded, so it must be joined
+    long long create_us;  // time spent inside pthread_create
+    long long ready_us;   // first run of the worker, relative to pool creation start
+    int cpu;              // pinned CPU, -1 when not pinned
+    int last_cpu;         // CPU the previous job started on
+    long long migrations; // jobs that started on a different CPU than the one before
+    long long lock_contended; // --lock-profile totals of this thread
+    long long lock_wait_ns;
+
+    // Live metrics: written only by the owning worker, read lock-free by
+    // the SIGUSR1 monitor. Aligned so workers never share a cache line.
+    long long jobs_done;
+    int busy;
+    unsigned int latency_hist[LAT_BUCKETS];
+} __attribute__((aligned(64))) worker_info;
+
+typedef struct lock_stat_t {
+    long long acquisitions;
+    long long contended;   // trylock failed, so the thread had to wait
+    long long wait_ns;
+    long long max_wait_ns;
+} lock_stat;
+
+// --virtual-time: a modelled worker, kept in a min-heap ordered by free_at
+typedef struct sim_worker_t {
+    long long free_at; // virtual ms when the worker finishes its last job
+    int id;
+} sim_worker;
+
+typedef enum { LINE_OTHER, LINE_WORKER, LINE_DISPATCHER_MSLEEP, LINE_DISPATCHER_WAIT } line_kind;
+
+// Reads the cmdfile in big blocks and hands out one line at a time
+typedef struct line_scanner_t {
+    int fd;
+    char* buf;          // SCAN_BUFFER_SIZE + SCAN_PADDING bytes
+    size_t start, end;  // unconsumed bytes are buf[start..end)
+    int eof;
+    int interrupted;    // last read() failed with EINTR
+} line_scanner;
+
+typedef const char* (*find_byte_fn)(const char* p, const char* end, char c);
+
+typedef struct spawner_arg_t {
+    int first;
+    int stride;
+    int num_threads;
+    int failed;
+} spawner_arg;
+
 // --- GLOBAL SYNCHRONIZATION & STATS ---
 pthread_mutex_t queue_mutex;
 pthread_cond_t queue_not_empty;
@@ -44,6 +144,11 @@ long long sum_turnaround = 0;
 long long min_turnaround = -1;
 long long max_turnaround = 0;
 long long total_jobs_done = 0;
+// Same numbers for the current batch only (--daemon), reset at dispatcher_wait
+long long batch_sum_turnaround = 0;
+long long batch_min_turnaround = -1;
+long long batch_max_turnaround = 0;
+long long batch_jobs_done = 0;
 pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int global_log_mode = 0;
@@ -56,15 +161,81 @@ job_queue* work_queue;
 // mem
 pthread_t* worker_thread_pool;
 int* tid;
+worker_info* workers;
+pthread_attr_t worker_attr;
+long long pool_start_us;
+long long pool_created_us; // time until every pthread_create returned
+
+// Options (see parse_option)
+size_t stack_kb = DEFAULT_STACK_KB;
+int num_spawners = 0;      // 0 = one per online CPU
+typedef enum { PIN_NONE, PIN_COMPACT, PIN_SCATTER } pin_mode;
+pin_mode worker_pin = PIN_NONE;
+const char* cpu_list_arg = NULL; // --cpus, NULL = CPUs we are allowed to run on
+int dispatcher_cpu = -1;
+int pin_cpus[CPU_SETSIZE];       // CPUs the workers are spread over
+int num_pin_cpus = 0;
+
+// Lock profiling: every thread records into its own table, merged on exit
+int lock_profile = 0;
+__thread lock_stat* thread_lock_stats = NULL;
+lock_stat total_lock_stats[NUM_PROFILED_LOCKS];
+pthread_mutex_t lock_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Live metrics (SIGUSR1 -> metrics.txt)
+long long jobs_read = 0;   // written by the dispatcher only
+int metrics_threads = 0;   // workers[] entries the monitor may look at
+int monitor_stop = 0;
+pthread_t monitor_thread_id;
+
+// Virtual time: sleeps advance a clock instead of blocking
+int virtual_time = 0;
+long long virtual_now_ms;      // dispatcher clock, same base as getCurrentTimeMs()
+long long virtual_busy_until;  // latest finish time of any modelled job
+sim_worker* sim_heap;
+int sim_workers = 0;
+
+// Idle worker strategy: condition variable, or spin then park on a futex
+typedef enum { WAIT_COND, WAIT_SPIN } wait_mode;
+wait_mode wait_strategy = WAIT_COND;
+int spin_max = DEFAULT_SPIN_MAX;
+int queue_futex = 0;       // bumped on every enqueue, parked workers sleep on it
+int spinning_workers = 0;
+int parked_workers = 0;
+long long futex_wakes = 0; // FUTEX_WAKE syscalls issued
+long long futex_waits = 0; // FUTEX_WAIT syscalls issued
+
+// Daemon mode: keep the pool alive across batches of a streamed cmdfile
+int daemon_mode = 0;
+const char* cmdfile_path = NULL;
+volatile sig_atomic_t daemon_stop = 0;
+sigset_t daemon_wait_mask; // the dispatcher's mask with SIGINT/SIGTERM let through
+int batch_number = 0;
+long long batch_start_ms = -1; // first line of the current batch, -1 = no batch yet
+
+// Byte search used by the cmdfile scanner, chosen once in main()
+const char* find_byte_scalar(const char* p, const char* end, char c);
+find_byte_fn find_byte = find_byte_scalar;
+const char* scanner_name = "scalar";
+const char* scanner_arg = "auto";
+int parse_bench = 0;
 // --- FUNCTION DECLARATIONS --- 
 
 long long getCurrentTimeMs();
+long long getCurrentTimeUs();
+long long getCurrentTimeNs();
+long long dispatcherTimeMs();
 void* worker_thread(void* arg);
 void parsingCommandFile(FILE* cmdfile);
 void enqueueJob(job_queue* queue, job* new_job);
 job* dequeueJob(job_queue* queue);
 int createWorkerThreads(int num_threads); // FIXED: Returns int, not void
 job_queue* queue_init();                  // FIXED: Returns pointer, not void
+int pin_to_cpu(int cpu);
+job* wait_for_job_spin(int* spin_budget);
+int daemon_next_input(FILE* cmdfile, line_scanner* sc);
+int daemon_wait_readable(int fd);
+void write_batch_stats();
 
 // --- HELPER FUNCTIONS ---
 long long getCurrentTimeMs() {
@@ -73,6 +244,379 @@ long long getCurrentTimeMs() {
     return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+// The dispatcher's idea of "now": the virtual clock under --virtual-time
+long long dispatcherTimeMs() {
+    return virtual_time ? virtual_now_ms : getCurrentTimeMs();
+}
+
+long long getCurrentTimeUs() {
+    return getCurrentTimeNs() / 1000;
+}
+
+long long getCurrentTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// --- CMDFILE SCANNER ---
+// find_byte returns the first c in [p, end), or end. The SIMD versions
+// compare 16/32 bytes at once and take the first hit from the movemask.
+const char* find_byte_scalar(const char* p, const char* end, char c) {
+    while (p < end && *p != c) p++;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+const char* find_byte_sse2(const char* p, const char* end, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    while (p + 16 <= end) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), needle));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+const char* find_byte_avx2(const char* p, const char* end, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    while (p + 32 <= end) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), needle));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_byte_sse2(p, end, c);
+}
+#endif
+
+// "auto" takes the widest one the CPU supports
+int select_scanner(const char* name) {
+    int want_auto = strcmp(name, "auto") == 0;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ((want_auto || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        find_byte = find_byte_avx2;
+        scanner_name = "avx2";
+        return 0;
+    }
+    if (want_auto || strcmp(name, "sse2") == 0) {
+        find_byte = find_byte_sse2;
+        scanner_name = "sse2";
+        return 0;
+    }
+#endif
+    if (want_auto || strcmp(name, "scalar") == 0) {
+        find_byte = find_byte_scalar;
+        scanner_name = "scalar";
+        return 0;
+    }
+    return -1;
+}
+
+// Token delimiters of the original strtok(line, " ;")
+static inline int is_token_end(char c) {
+    return c == ' ' || c == ';' || c == '\0';
+}
+
+// Keyword of a trimmed line. The line sits in a padded buffer, so reading
+// 16 bytes is always safe; a keyword only matches non-NUL bytes, so bytes
+// past the line's terminator can never produce a match.
+line_kind classify_line(const char* line) {
+#ifdef HAVE_X86_SIMD
+    static const char dispatcher_kw[16] = "dispatcher_msle";
+    unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)line),
+                                                   _mm_loadu_si128((const __m128i*)dispatcher_kw)));
+    if ((eq & 0x7FF) == 0x7FF) { // "dispatcher_"
+        if ((eq & 0x7FFF) == 0x7FFF && line[15] == 'e' && line[16] == 'p' && is_token_end(line[17]))
+            return LINE_DISPATCHER_MSLEEP;
+        if (memcmp(line + 11, "wait", 4) == 0 && is_token_end(line[15])) return LINE_DISPATCHER_WAIT;
+        return LINE_OTHER;
+    }
+#else
+    if (memcmp(line, "dispatcher_", 11) == 0) {
+        if (memcmp(line + 11, "msleep", 6) == 0 && is_token_end(line[17])) return LINE_DISPATCHER_MSLEEP;
+        if (memcmp(line + 11, "wait", 4) == 0 && is_token_end(line[15])) return LINE_DISPATCHER_WAIT;
+        return LINE_OTHER;
+    }
+#endif
+    if (memcmp(line, "worker", 6) == 0 && is_token_end(line[6])) return LINE_WORKER;
+    return LINE_OTHER;
+}
+
+int scanner_init(line_scanner* sc, int fd) {
+    sc->buf = (char*)malloc(SCAN_BUFFER_SIZE + SCAN_PADDING);
+    if (!sc->buf) {
+        fprintf(stderr, "Error: Could not allocate memory for the cmdfile buffer\n");
+        return -1;
+    }
+    memset(sc->buf + SCAN_BUFFER_SIZE, 0, SCAN_PADDING);
+    sc->fd = fd;
+    sc->start = sc->end = 0;
+    sc->eof = 0;
+    sc->interrupted = 0;
+    return 0;
+}
+
+// Returns the next line without its '\n', NUL terminated in place, or NULL
+// at EOF / on a read error. A line longer than the buffer comes back in
+// buffer sized pieces. read() returns whatever a pipe has, so lines are
+// handed out as soon as they arrive.
+char* scanner_next_line(line_scanner* sc) {
+    while (1) {
+        const char* from = sc->buf + sc->start;
+        const char* to = sc->buf + sc->end;
+        const char* nl = find_byte(from, to, '\n');
+        if (nl < to || (sc->eof && from < to) || (sc->start == 0 && sc->end == SCAN_BUFFER_SIZE)) {
+            char* line = sc->buf + sc->start;
+            size_t len = nl - from;
+            line[len] = '\0'; // a full buffer puts it in the padding
+            sc->start += len + (nl < to ? 1 : 0);
+            return line;
+        }
+        if (sc->eof) return NULL;
+
+        // Keep the partial line, then refill behind it
+        memmove(sc->buf, from, to - from);
+        sc->end = to - from;
+        sc->start = 0;
+        if (daemon_mode && daemon_wait_readable(sc->fd) != 0) {
+            sc->interrupted = (errno == EINTR);
+            return NULL;
+        }
+        ssize_t n = read(sc->fd, sc->buf + sc->end, SCAN_BUFFER_SIZE - sc->end);
+        if (n > 0) {
+            sc->end += n;
+            sc->buf[sc->end] = '\0';
+        } else if (n == 0) {
+            sc->eof = 1;
+        } else {
+            sc->interrupted = (errno == EINTR);
+            return NULL;
+        }
+    }
+}
+
+// --parse-bench: scan + classify the whole file in memory with every
+// available implementation and print the throughput
+int run_parse_bench(FILE* cmdfile) {
+    static const char* impls[] = { "scalar", "sse2", "avx2" };
+    struct stat st;
+    if (fstat(fileno(cmdfile), &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: --parse-bench needs a non-empty regular file\n");
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    char* data = (char*)malloc(size + SCAN_PADDING);
+    if (!data || fread(data, 1, size, cmdfile) != size) {
+        free(data);
+        return -1;
+    }
+    memset(data + size, 0, SCAN_PADDING);
+
+    for (int k = 0; k < 3; k++) {
+        if (select_scanner(impls[k]) != 0 || strcmp(scanner_name, impls[k]) != 0) continue;
+        long long lines = 0, keywords = 0;
+        int passes = 0;
+        long long t0 = getCurrentTimeNs();
+        long long elapsed;
+        do {
+            const char* p = data;
+            const char* end = data + size;
+            while (p < end) {
+                const char* nl = find_byte(p, end, '\n');
+                while (p < nl && isspace((unsigned char)*p)) p++;
+                if (p < nl) {
+                    lines++;
+                    if (classify_line(p) != LINE_OTHER) keywords++;
+                }
+                p = nl + 1;
+            }
+            passes++;
+            elapsed = getCurrentTimeNs() - t0;
+        } while (elapsed < 200000000LL); // at least 0.2 s per implementation
+        double gb = (double)size * passes / 1e9;
+        printf("%-7s %8.3f GB/s  (%d passes, %lld lines, %lld keyword lines)\n",
+               impls[k], gb / (elapsed / 1e9), passes, lines / passes, keywords / passes);
+    }
+    free(data);
+    return 0;
+}
+
+// --- LOCK PROFILING ---
+void profiled_lock_slow(pthread_mutex_t* m, int lock_id) {
+    if (!thread_lock_stats) {
+        thread_lock_stats = (lock_stat*)calloc(NUM_PROFILED_LOCKS, sizeof(lock_stat));
+        if (!thread_lock_stats) {
+            pthread_mutex_lock(m);
+            return;
+        }
+    }
+    lock_stat* ls = &thread_lock_stats[lock_id];
+    ls->acquisitions++;
+    if (pthread_mutex_trylock(m) == 0) return;
+
+    long long t0 = getCurrentTimeNs();
+    pthread_mutex_lock(m);
+    long long waited = getCurrentTimeNs() - t0;
+    ls->contended++;
+    ls->wait_ns += waited;
+    if (waited > ls->max_wait_ns) ls->max_wait_ns = waited;
+}
+
+// Plain pthread_mutex_lock unless --lock-profile is on
+static inline void profiled_lock(pthread_mutex_t* m, int lock_id) {
+    if (!lock_profile) {
+        pthread_mutex_lock(m);
+        return;
+    }
+    profiled_lock_slow(m, lock_id);
+}
+
+// Adds the calling thread's table to the totals; returns what it waited
+void merge_lock_stats(long long* contended, long long* wait_ns) {
+    *contended = 0;
+    *wait_ns = 0;
+    if (!thread_lock_stats) return;
+    pthread_mutex_lock(&lock_stats_mutex);
+    for (int k = 0; k < NUM_PROFILED_LOCKS; k++) {
+        lock_stat* src = &thread_lock_stats[k];
+        lock_stat* dst = &total_lock_stats[k];
+        dst->acquisitions += src->acquisitions;
+        dst->contended += src->contended;
+        dst->wait_ns += src->wait_ns;
+        if (src->max_wait_ns > dst->max_wait_ns) dst->max_wait_ns = src->max_wait_ns;
+        *contended += src->contended;
+        *wait_ns += src->wait_ns;
+    }
+    pthread_mutex_unlock(&lock_stats_mutex);
+    free(thread_lock_stats);
+    thread_lock_stats = NULL;
+}
+
+void write_lock_row(FILE* f, const char* name, lock_stat* ls) {
+    fprintf(f, "%-18s %12lld %10lld %10.2f %14.1f %12.1f %12.3f\n", name, ls->acquisitions, ls->contended,
+            ls->acquisitions ? 100.0 * ls->contended / ls->acquisitions : 0.0,
+            ls->wait_ns / 1000.0, ls->max_wait_ns / 1000.0,
+            ls->contended ? ls->wait_ns / 1000.0 / ls->contended : 0.0);
+}
+
+void write_lock_report(int num_threads, long long dispatcher_contended, long long dispatcher_wait_ns) {
+    FILE* f = fopen("locks.txt", "w");
+    if (!f) return;
+    fprintf(f, "%-18s %12s %10s %10s %14s %12s %12s\n", "lock", "acquisitions", "contended",
+            "contended%", "total wait us", "max wait us", "avg wait us");
+    write_lock_row(f, "queue_mutex", &total_lock_stats[LOCK_QUEUE]);
+    write_lock_row(f, "stats_mutex", &total_lock_stats[LOCK_STATS]);
+    for (int k = 0; k < MAX_COUNTERS; k++) {
+        if (total_lock_stats[LOCK_FILE_BASE + k].acquisitions == 0) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "file_mutexes[%d]", k);
+        write_lock_row(f, name, &total_lock_stats[LOCK_FILE_BASE + k]);
+    }
+    fprintf(f, "\n%-18s %10s %14s\n", "thread", "contended", "total wait us");
+    fprintf(f, "%-18s %10lld %14.1f\n", "dispatcher", dispatcher_contended, dispatcher_wait_ns / 1000.0);
+    for (int i = 0; i < num_threads; i++) {
+        if (!workers[i].created) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "thread%02d", i);
+        fprintf(f, "%-18s %10lld %14.1f\n", name, workers[i].lock_contended, workers[i].lock_wait_ns / 1000.0);
+    }
+    fprintf(f, "\nre-acquisitions inside pthread_cond_wait are not counted\n");
+    fclose(f);
+}
+
+// --- LIVE METRICS ---
+// Single-writer counters: the owner bumps them with relaxed stores, readers
+// use relaxed loads, so neither side takes a lock or a locked instruction.
+static inline void bump_ll(long long* c) {
+    __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+}
+
+static inline void bump_uint(unsigned int* c) {
+    __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+}
+
+int latency_bucket(long long ms) {
+    if (ms < LAT_EXACT) return ms < 0 ? 0 : (int)ms;
+    int exp = 63 - __builtin_clzll((unsigned long long)ms);
+    if (exp >= LAT_MAX_EXP) return LAT_BUCKETS - 1;
+    return (exp - 1) * 4 + (int)((ms >> (exp - 2)) & 3);
+}
+
+// Largest turnaround that still falls into bucket b
+long long latency_bucket_max(int b) {
+    if (b < LAT_EXACT) return b;
+    if (b == LAT_BUCKETS - 1) return LLONG_MAX;
+    int exp = b / 4 + 1;
+    long long low = (long long)(4 + b % 4) << (exp - 2);
+    return low + (1LL << (exp - 2)) - 1;
+}
+
+// Returns the upper bound of the bucket that holds the p-th percentile
+long long hist_percentile(const unsigned long long* hist, unsigned long long total, double p) {
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(p * total / 100.0);
+    if (rank >= total) rank = total - 1;
+    unsigned long long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return latency_bucket_max(b);
+    }
+    return latency_bucket_max(LAT_BUCKETS - 1);
+}
+
+void write_metrics(long long* prev_jobs, long long* prev_time_us) {
+    static unsigned long long hist[LAT_BUCKETS];
+    memset(hist, 0, sizeof(hist));
+    long long done = 0;
+    int busy = 0;
+    int n = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        done += __atomic_load_n(&workers[i].jobs_done, __ATOMIC_RELAXED);
+        busy += __atomic_load_n(&workers[i].busy, __ATOMIC_RELAXED);
+        for (int b = 0; b < LAT_BUCKETS; b++) hist[b] += __atomic_load_n(&workers[i].latency_hist[b], __ATOMIC_RELAXED);
+    }
+    long long now_us = getCurrentTimeUs();
+    long long elapsed_ms = getCurrentTimeMs() - start_time_global;
+    double interval_s = (now_us - *prev_time_us) / 1e6;
+    double current_rate = interval_s > 0 ? (done - *prev_jobs) / interval_s : 0.0;
+    *prev_jobs = done;
+    *prev_time_us = now_us;
+
+    FILE* f = fopen(METRICS_FILE ".tmp", "w");
+    if (!f) return;
+    fprintf(f, "uptime: %lld milliseconds\n", elapsed_ms);
+    fprintf(f, "queue depth: %d\n", __atomic_load_n(&work_queue->size, __ATOMIC_RELAXED));
+    fprintf(f, "active workers: %d of %d\n", busy, n);
+    fprintf(f, "jobs read: %lld\n", __atomic_load_n(&jobs_read, __ATOMIC_RELAXED));
+    fprintf(f, "jobs completed: %lld\n", done);
+    fprintf(f, "current throughput: %f jobs/sec\n", current_rate);
+    fprintf(f, "average throughput: %f jobs/sec\n", elapsed_ms > 0 ? done * 1000.0 / elapsed_ms : 0.0);
+    fprintf(f, "turnaround p50: <= %lld milliseconds\n", hist_percentile(hist, done, 50));
+    fprintf(f, "turnaround p90: <= %lld milliseconds\n", hist_percentile(hist, done, 90));
+    fprintf(f, "turnaround p99: <= %lld milliseconds\n", hist_percentile(hist, done, 99));
+    fclose(f);
+    rename(METRICS_FILE ".tmp", METRICS_FILE); // readers never see a half written file
+}
+
+// Sleeps in sigwait(); every SIGUSR1 sent to the process dumps a snapshot
+void* monitor_thread(void* arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    long long prev_jobs = 0;
+    long long prev_time_us = getCurrentTimeUs();
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (__atomic_load_n(&monitor_stop, __ATOMIC_ACQUIRE)) break;
+        write_metrics(&prev_jobs, &prev_time_us);
+    }
+    return NULL;
+}
+
 void write_log(const char* filename, const char* format, long long time, const char* str_arg) {
     if (!global_log_mode) return;
     FILE* fp = fopen(filename, "a");
@@ -82,12 +626,18 @@ void write_log(const char* filename, const char* format, long long time, const c
     }
 }
 
+void record_job_done(int worker_id, long long turnaround);
+
 void update_stats(long long turnaround) {
-    pthread_mutex_lock(&stats_mutex);
+    profiled_lock(&stats_mutex, LOCK_STATS);
     sum_turnaround += turnaround;
     if (min_turnaround == -1 || turnaround < min_turnaround) min_turnaround = turnaround;
     if (turnaround > max_turnaround) max_turnaround = turnaround;
     total_jobs_done++;
+    batch_sum_turnaround += turnaround;
+    if (batch_min_turnaround == -1 || turnaround < batch_min_turnaround) batch_min_turnaround = turnaround;
+    if (turnaround > batch_max_turnaround) batch_max_turnaround = turnaround;
+    batch_jobs_done++;
     pthread_mutex_unlock(&stats_mutex);
 }
 
@@ -97,11 +647,12 @@ void modify_counter(int counter_id, int val) {
     snprintf(filename, sizeof(filename), "count%02d.txt", counter_id);
     
     // Lock specific counter mutex to prevent race conditions
-    if(counter_id < MAX_COUNTERS) pthread_mutex_lock(&file_mutexes[counter_id]);
+    int has_mutex = counter_id >= 0 && counter_id < MAX_COUNTERS;
+    if(has_mutex) profiled_lock(&file_mutexes[counter_id], LOCK_FILE_BASE + counter_id);
 
     FILE* f = fopen(filename, "r+");
     if (!f) {
-        if(counter_id < MAX_COUNTERS) pthread_mutex_unlock(&file_mutexes[counter_id]);
+        if(has_mutex) pthread_mutex_unlock(&file_mutexes[counter_id]);
         return;
     }
 
@@ -115,101 +666,334 @@ void modify_counter(int counter_id, int val) {
     ftruncate(fileno(f), ftell(f)); 
     fclose(f);
 
-    if(counter_id < MAX_COUNTERS) pthread_mutex_unlock(&file_mutexes[counter_id]);
+    if(has_mutex) pthread_mutex_unlock(&file_mutexes[counter_id]);
 }
 
 // --- WORKER LOGIC ---
-void execute_worker_line(char* line) {
-    char* context_save = NULL;
-    char* cmd_token = strtok_r(line, ";", &context_save);
-    
-    while (cmd_token != NULL) {
+// Decodes "msleep 5; repeat 3; increment 1" into ops. A repeat covers the
+// rest of the line, so each repeat is nested inside the previous one.
+int parse_job_ops(char* line, job_op* ops) {
+    int n = 0;
+    int last_repeat = -1;
+    char* end = line + strlen(line);
+    char* cmd_token = line;
+
+    while (cmd_token < end && n < MAX_JOB_OPS) {
+        char* semi = (char*)find_byte(cmd_token, end, ';');
+        *semi = '\0';
         while(isspace((unsigned char)*cmd_token)) cmd_token++;
-        
+
         if (strncmp(cmd_token, "msleep", 6) == 0) {
-            int ms = atoi(cmd_token + 6);
-            usleep(ms * 1000);
+            ops[n].kind = OP_MSLEEP;
+            ops[n++].arg = atoi(cmd_token + 6);
         } else if (strncmp(cmd_token, "increment", 9) == 0) {
-            int id = atoi(cmd_token + 9);
-            modify_counter(id, 1);
+            ops[n].kind = OP_INCREMENT;
+            ops[n++].arg = atoi(cmd_token + 9);
         } else if (strncmp(cmd_token, "decrement", 9) == 0) {
-            int id = atoi(cmd_token + 9);
-            modify_counter(id, -1);
+            ops[n].kind = OP_DECREMENT;
+            ops[n++].arg = atoi(cmd_token + 9);
         } else if (strncmp(cmd_token, "repeat", 6) == 0) {
-            int reps = atoi(cmd_token + 6);
-            char* rest = NULL;
-             if (context_save && *context_save != '\0') {
-                 rest = context_save;
-            }
-            if (rest) {
-                char* sequence = strdup(rest);
-                for(int i=0; i < reps; i++) {
-                    char* seq_copy = strdup(sequence);
-                    execute_worker_line(seq_copy);
-                    free(seq_copy);
-                }
-                free(sequence);
+            ops[n].kind = OP_REPEAT;
+            ops[n].arg = atoi(cmd_token + 6);
+            ops[n].outer = last_repeat;
+            last_repeat = n++;
+        }
+        cmd_token = semi + 1;
+    }
+    return n;
+}
+
+// Runs the ops without recursion: nested repeats are walked through the
+// 'outer' links, so the stack use is the same for any repeat depth.
+// With virtual_ms set, msleep adds to it instead of sleeping.
+void run_job_ops(job_op* ops, int n, long long* virtual_ms) {
+    int pc = 0;
+    int loop = -1; // innermost running repeat
+
+    while (1) {
+        if (pc < n) {
+            job_op* op = &ops[pc];
+            switch (op->kind) {
+                case OP_MSLEEP:
+                    if (virtual_ms) *virtual_ms += op->arg;
+                    else usleep(op->arg * 1000);
+                    break;
+                case OP_INCREMENT: modify_counter(op->arg, 1); break;
+                case OP_DECREMENT: modify_counter(op->arg, -1); break;
+                case OP_REPEAT:
+                    if (op->arg > 0) {
+                        op->left = op->arg;
+                        loop = pc;
+                        pc++;
+                        continue;
+                    }
+                    pc = n; // "repeat 0" skips the rest of the line
+                    continue;
             }
-             break;
+            pc++;
+            continue;
         }
-        cmd_token = strtok_r(NULL, ";", &context_save);
+
+        // End of the line: go around the innermost repeat again, or unwind
+        while (loop >= 0 && --ops[loop].left <= 0) loop = ops[loop].outer;
+        if (loop < 0) break;
+        pc = loop + 1;
     }
 }
 
+void execute_worker_line(char* line, long long* virtual_ms) {
+    job_op* ops = (job_op*)malloc(MAX_JOB_OPS * sizeof(job_op));
+    if (!ops) {
+        fprintf(stderr, "Error: Could not allocate memory for job ops\n");
+        return;
+    }
+    int n = parse_job_ops(line, ops);
+    run_job_ops(ops, n, virtual_ms);
+    free(ops);
+}
+
+// Runs the ops of a "worker ..." command line
+void run_job_command(const char* command, long long* virtual_ms) {
+    char* line_copy = strdup(command);
+    if (!line_copy) return;
+    char* commands_start = strstr(line_copy, "worker");
+    if (commands_start) commands_start += 6; 
+    else commands_start = line_copy;
+
+    execute_worker_line(commands_start, virtual_ms);
+    free(line_copy);
+}
+
 void* worker_thread(void* arg) {
     int id = *(int*)arg;
+    workers[id].ready_us = getCurrentTimeUs() - pool_start_us;
     char log_file[32];
     snprintf(log_file, sizeof(log_file), "thread%02d.txt", id);
+
+    if (workers[id].cpu >= 0 && pin_to_cpu(workers[id].cpu) != 0) {
+        fprintf(stderr, "Warning: could not pin worker %d to cpu %d\n", id, workers[id].cpu);
+        workers[id].cpu = -1;
+    }
+    workers[id].last_cpu = sched_getcpu();
     
     if (global_log_mode) {
         FILE* f = fopen(log_file, "w");
-        if(f) fclose(f);
+        if(f) {
+            if (worker_pin != PIN_NONE) {
+                fprintf(f, "TIME %lld: worker %d affinity cpu %d (%s)\n", getCurrentTimeMs() - start_time_global,
+                        id, workers[id].cpu, worker_pin == PIN_COMPACT ? "compact" : "scatter");
+            }
+            fclose(f);
+        }
     }
 
+    int spin_budget = spin_max;
     while (1) {
-        pthread_mutex_lock(&queue_mutex);
-        
-        while (work_queue->size == 0 && !shutdown_flag) {
-            pthread_cond_wait(&queue_not_empty, &queue_mutex);
-        }
+        job* j;
+        if (wait_strategy == WAIT_SPIN) {
+            j = wait_for_job_spin(&spin_budget);
+            if (!j) break;
+        } else {
+            profiled_lock(&queue_mutex, LOCK_QUEUE);
+            
+            while (work_queue->size == 0 && !shutdown_flag) {
+                pthread_cond_wait(&queue_not_empty, &queue_mutex);
+            }
+
+            if (shutdown_flag && work_queue->size == 0) {
+                pthread_mutex_unlock(&queue_mutex);
+                break;
+            }
 
-        if (shutdown_flag && work_queue->size == 0) {
+            j = dequeueJob(work_queue);
+            active_workers++; 
             pthread_mutex_unlock(&queue_mutex);
-            break;
         }
-
-        job* j = dequeueJob(work_queue);
-        active_workers++; 
-        pthread_mutex_unlock(&queue_mutex);
+        __atomic_store_n(&workers[id].busy, 1, __ATOMIC_RELAXED);
 
         if (j) {
+            int cpu = sched_getcpu();
+            if (cpu != workers[id].last_cpu) {
+                workers[id].migrations++;
+                workers[id].last_cpu = cpu;
+            }
             long long start_t = getCurrentTimeMs();
             write_log(log_file, "TIME %lld: START job %s\n", start_t, j->command);
             
-            char* line_copy = strdup(j->command);
-            char* commands_start = strstr(line_copy, "worker");
-            if (commands_start) commands_start += 6; 
-            else commands_start = line_copy;
-
-            execute_worker_line(commands_start);
-            free(line_copy);
+            run_job_command(j->command, NULL);
 
             long long end_t = getCurrentTimeMs();
             write_log(log_file, "TIME %lld: END job %s\n", end_t, j->command);
-            update_stats(end_t - j->read_time_ms);
+            record_job_done(id, end_t - j->read_time_ms);
             free(j);
         }
+        __atomic_store_n(&workers[id].busy, 0, __ATOMIC_RELAXED);
 
-        pthread_mutex_lock(&queue_mutex);
+        profiled_lock(&queue_mutex, LOCK_QUEUE);
         active_workers--;
         if (work_queue->size == 0 && active_workers == 0) {
             pthread_cond_signal(&all_jobs_finished);
         }
         pthread_mutex_unlock(&queue_mutex);
     }
+    merge_lock_stats(&workers[id].lock_contended, &workers[id].lock_wait_ns);
     return NULL;
 }
 
+void record_job_done(int worker_id, long long turnaround) {
+    update_stats(turnaround);
+    bump_uint(&workers[worker_id].latency_hist[latency_bucket(turnaround)]);
+    bump_ll(&workers[worker_id].jobs_done);
+}
+
+// --- VIRTUAL TIME SIMULATION ---
+// Discrete-event model of the pool: the queue is FIFO and a job goes to
+// the worker that becomes idle first (lowest id on ties), which is what
+// the real pool does when workers are free. A job takes as long as the
+// sum of its msleeps; counter ops still update the count files.
+
+static int sim_before(const sim_worker* a, const sim_worker* b) {
+    return a->free_at < b->free_at || (a->free_at == b->free_at && a->id < b->id);
+}
+
+void sim_sift_down(int i) {
+    while (1) {
+        int smallest = i;
+        int l = 2 * i + 1, r = 2 * i + 2;
+        if (l < sim_workers && sim_before(&sim_heap[l], &sim_heap[smallest])) smallest = l;
+        if (r < sim_workers && sim_before(&sim_heap[r], &sim_heap[smallest])) smallest = r;
+        if (smallest == i) return;
+        sim_worker tmp = sim_heap[i];
+        sim_heap[i] = sim_heap[smallest];
+        sim_heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+int sim_init(int num_threads) {
+    sim_heap = (sim_worker*)malloc(num_threads * sizeof(sim_worker));
+    if (!sim_heap) {
+        fprintf(stderr, "Error: Could not allocate memory for virtual workers\n");
+        return -1;
+    }
+    // All free at the start, ids in order already form a valid heap
+    for (int i = 0; i < num_threads; i++) {
+        sim_heap[i].free_at = start_time_global;
+        sim_heap[i].id = i;
+        if (global_log_mode) {
+            char log_file[32];
+            snprintf(log_file, sizeof(log_file), "thread%02d.txt", i);
+            FILE* f = fopen(log_file, "w");
+            if (f) fclose(f);
+        }
+    }
+    sim_workers = num_threads;
+    virtual_now_ms = start_time_global;
+    virtual_busy_until = start_time_global;
+    return 0;
+}
+
+void sim_run_job(job* j) {
+    sim_worker* w = &sim_heap[0];
+    long long start_t = (j->read_time_ms > w->free_at) ? j->read_time_ms : w->free_at;
+    long long duration = 0;
+    run_job_command(j->command, &duration);
+    long long end_t = start_t + duration;
+
+    char log_file[32];
+    snprintf(log_file, sizeof(log_file), "thread%02d.txt", w->id);
+    write_log(log_file, "TIME %lld: START job %s\n", start_t, j->command);
+    write_log(log_file, "TIME %lld: END job %s\n", end_t, j->command);
+    record_job_done(w->id, end_t - j->read_time_ms);
+
+    w->free_at = end_t;
+    if (end_t > virtual_busy_until) virtual_busy_until = end_t;
+    sim_sift_down(0);
+}
+
+// dispatcher_wait: jump to the moment the last job finishes
+void sim_wait_all() {
+    if (virtual_busy_until > virtual_now_ms) virtual_now_ms = virtual_busy_until;
+}
+
+// --- SPIN-THEN-PARK WAITING ---
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static long futex(int* addr, int op, int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// Called after a job was queued. A spinning worker will see it by itself,
+// so the wake syscall is only paid when everybody idle is parked.
+void notify_job_queued() {
+    __atomic_add_fetch(&queue_futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&spinning_workers, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&parked_workers, __ATOMIC_SEQ_CST) > 0) {
+        futex(&queue_futex, FUTEX_WAKE_PRIVATE, 1);
+        __atomic_add_fetch(&futex_wakes, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int queue_has_work() {
+    return __atomic_load_n(&work_queue->size, __ATOMIC_SEQ_CST) > 0 ||
+           __atomic_load_n(&shutdown_flag, __ATOMIC_SEQ_CST);
+}
+
+// Returns the next job, or NULL once shutdown is set and the queue is empty.
+// The spin budget adapts per worker: doubled when spinning found work,
+// halved when the worker had to park anyway.
+job* wait_for_job_spin(int* spin_budget) {
+    while (1) {
+        if (queue_has_work()) {
+            profiled_lock(&queue_mutex, LOCK_QUEUE);
+            if (work_queue->size > 0) {
+                job* j = dequeueJob(work_queue);
+                active_workers++;
+                int more = work_queue->size > 0;
+                pthread_mutex_unlock(&queue_mutex);
+                if (more) notify_job_queued(); // pass the burst on to a parked worker
+                return j;
+            }
+            int done = shutdown_flag;
+            pthread_mutex_unlock(&queue_mutex);
+            if (done) return NULL;
+        }
+
+        __atomic_add_fetch(&spinning_workers, 1, __ATOMIC_SEQ_CST);
+        int found = 0;
+        for (int k = 0; k < *spin_budget; k++) {
+            if (queue_has_work()) {
+                found = 1;
+                break;
+            }
+            cpu_relax();
+        }
+        __atomic_sub_fetch(&spinning_workers, 1, __ATOMIC_SEQ_CST);
+        if (found) {
+            if (*spin_budget < spin_max) *spin_budget *= 2;
+            continue;
+        }
+        if (*spin_budget > SPIN_MIN) *spin_budget /= 2;
+
+        // Park. Reading the futex word before announcing ourselves means an
+        // enqueue that races with us either sees parked_workers or changes
+        // the word, so FUTEX_WAIT returns at once.
+        int seq = __atomic_load_n(&queue_futex, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+        if (!queue_has_work()) {
+            __atomic_add_fetch(&futex_waits, 1, __ATOMIC_RELAXED);
+            futex(&queue_futex, FUTEX_WAIT_PRIVATE, seq);
+        }
+        __atomic_sub_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
 // --- QUEUE & THREAD CREATION ---
 
 job_queue* queue_init(){ // FIXED: return type
@@ -232,7 +1016,7 @@ void enqueueJob(job_queue* queue, job* new_job){
         queue->tail->next = new_job;
         queue->tail = new_job;
     }
-    queue->size++;
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED); // read lock-free by the monitor
 }
 
 job* dequeueJob(job_queue* queue){
@@ -242,11 +1026,109 @@ job* dequeueJob(job_queue* queue){
     }
     dequeued_job = queue->head;
     queue->head = queue->head->next;
-    queue->size--;
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
     return dequeued_job;
 }
 
+// --- CPU AFFINITY ---
+int pin_to_cpu(int cpu){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// "0-3,8,10-11" -> pin_cpus
+int parse_cpu_list(const char* list){
+    num_pin_cpus = 0;
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long c = first; c <= last && num_pin_cpus < CPU_SETSIZE; c++) pin_cpus[num_pin_cpus++] = (int)c;
+        p = end;
+        if (*p == ',') p++;
+        else if (*p != '\0') return -1;
+    }
+    return num_pin_cpus > 0 ? 0 : -1;
+}
+
+// Fills pin_cpus and decides the CPU of every worker.
+// compact: neighbouring workers share a CPU (or neighbouring CPUs),
+// scatter: neighbouring workers are spread as far apart as the list allows.
+int assignWorkerCpus(int num_threads){
+    for (int i = 0; i < num_threads; i++) workers[i].cpu = -1;
+    if (worker_pin == PIN_NONE) return 0;
+
+    if (cpu_list_arg) {
+        if (parse_cpu_list(cpu_list_arg) != 0) {
+            fprintf(stderr, "Error: bad cpu list %s\n", cpu_list_arg);
+            return -1;
+        }
+    } else {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+        num_pin_cpus = 0;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) pin_cpus[num_pin_cpus++] = c;
+        }
+    }
+
+    // The dispatcher keeps its core to itself whenever there is another one
+    if (dispatcher_cpu >= 0 && num_pin_cpus > 1) {
+        int n = 0;
+        for (int k = 0; k < num_pin_cpus; k++) {
+            if (pin_cpus[k] != dispatcher_cpu) pin_cpus[n++] = pin_cpus[k];
+        }
+        num_pin_cpus = n;
+    }
+
+    long long n = num_pin_cpus;
+    for (int i = 0; i < num_threads; i++) {
+        long long slot;
+        if (worker_pin == PIN_COMPACT) slot = (num_threads <= n) ? i : i * n / num_threads;
+        else                           slot = (num_threads <= n) ? i * n / num_threads : i % n;
+        workers[i].cpu = pin_cpus[slot];
+    }
+    return 0;
+}
+
+int spawnWorker(int i){
+    tid[i] = i;
+    long long t0 = getCurrentTimeUs();
+    int rc = pthread_create(&worker_thread_pool[i], &worker_attr, worker_thread, &tid[i]);
+    workers[i].create_us = getCurrentTimeUs() - t0;
+    if(rc != 0){
+        fprintf(stderr, "Error: Could not create worker thread %d: %s\n", i, strerror(rc));
+        return -1;
+    }
+    workers[i].created = 1;
+    return 0;
+}
+
+// Each spawner creates every 'stride'-th worker, so pthread_create calls
+// (mmap of the stack, clone) run on several CPUs at once.
+void* spawner_thread(void* arg){
+    spawner_arg* sp = (spawner_arg*)arg;
+    for(int i = sp->first; i < sp->num_threads; i += sp->stride){
+        if(spawnWorker(i) != 0) sp->failed = 1;
+    }
+    return NULL;
+}
+
+// 0 when the whole pool is up, 1 when only some workers started and -1 when
+// none did, in which case no job could ever run
 int createWorkerThreads(int num_threads){ // FIXED: return type
+    // First, so the cleanup in dispatcher() always has an attr to destroy
+    pthread_attr_init(&worker_attr);
     // FIXED: Casting malloc to (pthread_t*) instead of (int)
     worker_thread_pool = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
     if(!worker_thread_pool){
@@ -259,66 +1141,285 @@ int createWorkerThreads(int num_threads){ // FIXED: return type
         fprintf(stderr, "Error: Could not allocate memory for thread IDs\n");
         return -1;
     }
-    for(int i= 0; i< num_threads; i++){
-        tid[i] = i;
-        if(pthread_create(&worker_thread_pool[i], NULL, worker_thread, &tid[i]) != 0){
-            fprintf(stderr, "Error: Could not create worker thread %d: %s\n", i, strerror(errno));
-            return -1;
+    workers = (worker_info*)aligned_alloc(64, num_threads * sizeof(worker_info));
+    if(workers) memset(workers, 0, num_threads * sizeof(worker_info));
+    if(!workers){
+        fprintf(stderr, "Error: Could not allocate memory for worker info\n");
+        return -1;
+    }
+
+    if(assignWorkerCpus(num_threads) != 0){
+        return -1;
+    }
+
+    size_t stack_bytes = stack_kb * 1024;
+    if(stack_bytes < (size_t)PTHREAD_STACK_MIN) stack_bytes = PTHREAD_STACK_MIN;
+    if(pthread_attr_setstacksize(&worker_attr, stack_bytes) != 0){
+        fprintf(stderr, "Error: Invalid worker stack size %zu KB\n", stack_kb);
+        return -1;
+    }
+
+    if(virtual_time){
+        // Workers are modelled by the simulator, no threads are started
+        pool_created_us = 0;
+        __atomic_store_n(&metrics_threads, num_threads, __ATOMIC_RELEASE);
+        return sim_init(num_threads);
+    }
+
+    int spawners = num_spawners;
+    if(spawners <= 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        spawners = (cpus > 0) ? (int)cpus : 1;
+    }
+    int max_useful = (num_threads + WORKERS_PER_SPAWNER - 1) / WORKERS_PER_SPAWNER;
+    if(spawners > max_useful) spawners = max_useful;
+    if(spawners < 1) spawners = 1;
+
+    int failed = 0;
+    pool_start_us = getCurrentTimeUs();
+    if(spawners == 1){
+        for(int i= 0; i< num_threads; i++){
+            if(spawnWorker(i) != 0) failed = 1;
         }
-    } 
-    return 0;   
+    } else {
+        pthread_t spawner_pool[spawners];
+        spawner_arg args[spawners];
+        int running = 0;
+        for(int s = 0; s < spawners; s++){
+            args[s].first = s;
+            args[s].stride = spawners;
+            args[s].num_threads = num_threads;
+            args[s].failed = 0;
+        }
+        for(int s = 0; s < spawners; s++){
+            if(pthread_create(&spawner_pool[s], &worker_attr, spawner_thread, &args[s]) != 0) break;
+            running++;
+        }
+        for(int s = 0; s < running; s++){
+            pthread_join(spawner_pool[s], NULL);
+            if(args[s].failed) failed = 1;
+        }
+        // Whatever a missing spawner should have created is done here
+        for(int s = running; s < spawners; s++){
+            spawner_thread(&args[s]);
+            if(args[s].failed) failed = 1;
+        }
+    }
+    pool_created_us = getCurrentTimeUs() - pool_start_us;
+    __atomic_store_n(&metrics_threads, num_threads, __ATOMIC_RELEASE);
+    int started = 0;
+    for(int i = 0; i < num_threads; i++) started += workers[i].created;
+    if(started == 0) return -1;
+    return failed ? 1 : 0;
 }
 
 void parsingCommandFile(FILE* cmdfile){
-    char* token;
-    char line_buffer[MAX_LINE_LENGTH];
     job* new_job=NULL;
+    line_scanner sc;
+    if (scanner_init(&sc, fileno(cmdfile)) != 0) return;
     
-    while(fgets(line_buffer, sizeof(line_buffer), cmdfile) != NULL){
+    while(1){
+        char* line = scanner_next_line(&sc);
+        if(line == NULL){
+            // --daemon: wait for the next producer instead of stopping at EOF
+            if(daemon_mode && daemon_next_input(cmdfile, &sc) == 0) continue;
+            break;
+        }
         // Remove whitespace logic...
-        char* start = line_buffer;
+        char* start = line;
         while(isspace((unsigned char)*start)) start++;
         if(*start == '\0') continue; // Empty line
         
         char* end = start + strlen(start) - 1;
         while(end > start && isspace((unsigned char)*end)) end--;
         *(end + 1) = '\0';
+        // Longer lines than a job can hold are cut, like fgets() used to
+        if (end + 1 - start >= MAX_LINE_LENGTH) start[MAX_LINE_LENGTH - 1] = '\0';
         char* cleanLine = start;
+        if (daemon_mode && batch_start_ms < 0) batch_start_ms = dispatcherTimeMs();
 
-        write_log("dispatcher.txt", "TIME %lld: read cmd line: %s\n", getCurrentTimeMs(), cleanLine);
+        write_log("dispatcher.txt", "TIME %lld: read cmd line: %s\n", dispatcherTimeMs(), cleanLine);
 
-        char parsing_copy[MAX_LINE_LENGTH];
-        strcpy(parsing_copy, cleanLine);
-
-        token = strtok(parsing_copy, " ;"); 
-        
-        if(token == NULL) continue;
+        line_kind kind = classify_line(cleanLine);
 
-        if (strcmp(token, "worker") == 0) {
+        if (kind == LINE_WORKER) {
             new_job = (job*)malloc(sizeof(job));
             new_job->next = NULL;
             strcpy(new_job->command, cleanLine);
-            new_job->read_time_ms = getCurrentTimeMs();
+            new_job->read_time_ms = dispatcherTimeMs();
 
-            pthread_mutex_lock(&queue_mutex);
+            if (virtual_time) {
+                bump_ll(&jobs_read);
+                sim_run_job(new_job);
+                free(new_job);
+                continue;
+            }
+
+            profiled_lock(&queue_mutex, LOCK_QUEUE);
             enqueueJob(work_queue, new_job);
             pending_jobs++;
-            pthread_cond_signal(&queue_not_empty);
+            bump_ll(&jobs_read);
+            if (wait_strategy == WAIT_COND) pthread_cond_signal(&queue_not_empty);
             pthread_mutex_unlock(&queue_mutex);
+            if (wait_strategy == WAIT_SPIN) notify_job_queued();
 
-        } else if (strcmp(token, "dispatcher_msleep") == 0) {
-            token = strtok(NULL, " ;");
-            if (token) {
-                usleep(atoi(token) * 1000);
+        } else if (kind == LINE_DISPATCHER_MSLEEP) {
+            char* arg = cleanLine + 17;
+            while (*arg == ' ' || *arg == ';') arg++;
+            if (*arg) {
+                if (virtual_time) virtual_now_ms += atoi(arg);
+                else usleep(atoi(arg) * 1000);
             }
-        } else if (strcmp(token, "dispatcher_wait") == 0) {
-            pthread_mutex_lock(&queue_mutex);
-            while (work_queue->size > 0 || active_workers > 0) {
-                pthread_cond_wait(&all_jobs_finished, &queue_mutex);
+        } else if (kind == LINE_DISPATCHER_WAIT) {
+            if (virtual_time) {
+                sim_wait_all();
+            } else {
+                profiled_lock(&queue_mutex, LOCK_QUEUE);
+                while (work_queue->size > 0 || active_workers > 0) {
+                    pthread_cond_wait(&all_jobs_finished, &queue_mutex);
+                }
+                pthread_mutex_unlock(&queue_mutex);
             }
-            pthread_mutex_unlock(&queue_mutex);
+            if (daemon_mode) write_batch_stats();
         }
     }
+    free(sc.buf);
+}
+
+// The five lines the assignment defines for stats.txt
+void write_turnaround_stats(FILE* statf, long long total_run, long long sum, long long min,
+                            long long max, long long jobs) {
+    double avg = (jobs > 0) ? (double)sum / jobs : 0.0;
+    fprintf(statf, "total running time: %lld milliseconds\n", total_run);
+    fprintf(statf, "sum of jobs turnaround time: %lld milliseconds\n", sum);
+    fprintf(statf, "min job turnaround time: %lld milliseconds\n", (min == -1 ? 0 : min));
+    fprintf(statf, "average job turnaround time: %f milliseconds\n", avg);
+    fprintf(statf, "max job turnaround time: %lld milliseconds\n", max);
+}
+
+// --daemon: one block per dispatcher_wait, appended to stats.txt.
+// Called with every job finished, so no worker touches the batch numbers.
+void write_batch_stats() {
+    profiled_lock(&stats_mutex, LOCK_STATS);
+    long long sum = batch_sum_turnaround, min = batch_min_turnaround;
+    long long max = batch_max_turnaround, jobs = batch_jobs_done;
+    batch_sum_turnaround = 0;
+    batch_min_turnaround = -1;
+    batch_max_turnaround = 0;
+    batch_jobs_done = 0;
+    pthread_mutex_unlock(&stats_mutex);
+
+    long long now = dispatcherTimeMs();
+    FILE* statf = fopen("stats.txt", "a");
+    if (statf) {
+        fprintf(statf, "batch %d: %lld jobs\n", ++batch_number, jobs);
+        write_turnaround_stats(statf, batch_start_ms < 0 ? 0 : now - batch_start_ms, sum, min, max, jobs);
+        fclose(statf);
+    }
+    batch_start_ms = -1;
+}
+
+void daemon_signal_handler(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// SIGINT/SIGTERM stay blocked in the dispatcher except inside this ppoll(),
+// so one that comes after the last daemon_stop check is not lost: it is
+// pending, and ends the wait with EINTR.
+int daemon_wait_readable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (ppoll(&pfd, 1, NULL, &daemon_wait_mask) < 0) {
+        if (errno != EINTR || daemon_stop) return -1;
+    }
+    return 0;
+}
+
+// At EOF: a FIFO is reopened so the next producer can write to it, stdin
+// or a regular file ends the run. Returns 0 to keep reading.
+int daemon_next_input(FILE* cmdfile, line_scanner* sc) {
+    if (daemon_stop) return -1;
+    if (sc->interrupted) {
+        sc->interrupted = 0;
+        return 0;
+    }
+    struct stat st;
+    if (cmdfile == stdin || fstat(fileno(cmdfile), &st) != 0 || !S_ISFIFO(st.st_mode)) return -1;
+    // O_NONBLOCK so the open does not wait for a writer; the wait is the
+    // ppoll(), which a stop signal can interrupt
+    int fd = open(cmdfile_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (daemon_wait_readable(fd) != 0 || fcntl(fd, F_SETFL, 0) != 0 || dup2(fd, fileno(cmdfile)) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    sc->eof = 0;
+    return 0;
+}
+
+// Turnaround percentiles from the per-worker histograms, appended to stats.txt
+void write_latency_stats(FILE* statf, int num_threads) {
+    static unsigned long long hist[LAT_BUCKETS];
+    memset(hist, 0, sizeof(hist));
+    unsigned long long done = 0;
+    for (int i = 0; i < num_threads; i++) {
+        done += workers[i].jobs_done;
+        for (int b = 0; b < LAT_BUCKETS; b++) hist[b] += workers[i].latency_hist[b];
+    }
+    // Bucket bounds can overshoot, the exact max is known
+    double pcts[3] = { 50, 90, 99 };
+    for (int k = 0; k < 3; k++) {
+        long long v = hist_percentile(hist, done, pcts[k]);
+        if (v > max_turnaround) v = max_turnaround;
+        fprintf(statf, "p%d job turnaround time: %lld milliseconds\n", (int)pcts[k], v);
+    }
+}
+
+// Thread creation cost and memory per worker, appended to stats.txt
+void write_pool_stats(FILE* statf, int num_threads) {
+    size_t stack_bytes = 0, guard_bytes = 0;
+    pthread_attr_getstacksize(&worker_attr, &stack_bytes);
+    pthread_attr_getguardsize(&worker_attr, &guard_bytes);
+
+    long long sum_create = 0, max_create = 0, last_ready = 0;
+    int created = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (!workers[i].created) continue;
+        created++;
+        sum_create += workers[i].create_us;
+        if (workers[i].create_us > max_create) max_create = workers[i].create_us;
+        if (workers[i].ready_us > last_ready) last_ready = workers[i].ready_us;
+    }
+    size_t per_worker_kb = (stack_bytes + guard_bytes) / 1024;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    if (virtual_time) fprintf(statf, "virtual time: %d workers simulated\n", num_threads);
+    fprintf(statf, "worker threads created: %d of %d\n", created, num_threads);
+    fprintf(statf, "worker stack size: %zu KB\n", stack_bytes / 1024);
+    fprintf(statf, "worker memory footprint: %zu KB (stack + guard page)\n", per_worker_kb);
+    fprintf(statf, "worker pool virtual memory: %zu KB\n", per_worker_kb * created);
+    fprintf(statf, "thread creation time: %lld microseconds (average %f, max %lld)\n",
+            pool_created_us, created ? (double)sum_create / created : 0.0, max_create);
+    fprintf(statf, "thread pool ready time: %lld microseconds\n", last_ready);
+    fprintf(statf, "peak resident memory: %ld KB\n", ru.ru_maxrss);
+
+    long long migrations = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (workers[i].created) migrations += workers[i].migrations;
+    }
+    fprintf(statf, "worker affinity: %s\n",
+            worker_pin == PIN_COMPACT ? "compact" : worker_pin == PIN_SCATTER ? "scatter" : "none");
+    fprintf(statf, "dispatcher cpu: %d\n", dispatcher_cpu);
+    fprintf(statf, "worker cpu migrations between jobs: %lld\n", migrations);
+
+    fprintf(statf, "worker wait strategy: %s\n", wait_strategy == WAIT_SPIN ? "spin then park" : "condition variable");
+    if (wait_strategy == WAIT_SPIN) {
+        fprintf(statf, "futex wake syscalls: %lld (%f per job)\n", futex_wakes,
+                total_jobs_done ? (double)futex_wakes / total_jobs_done : 0.0);
+        fprintf(statf, "futex wait syscalls: %lld\n", futex_waits);
+    }
 }
 
 // --- DISPATCHER & MAIN ---
@@ -347,40 +1448,104 @@ int dispatcher(FILE* cmdfile, int num_threads, int num_counters, int log_mode){
     }
 
     work_queue = queue_init(); 
-    createWorkerThreads(num_threads);
+
+    // SIGUSR1 is handled by the monitor thread only; every other thread
+    // inherits this mask, so the signal can never interrupt a job's usleep
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    // --daemon: SIGINT/SIGTERM end the run, but only the dispatcher sees them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    if (daemon_mode) pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    int pool = createWorkerThreads(num_threads);
+    if (pool < 0) {
+        fprintf(stderr, "Error: no worker thread could be started\n");
+        return -1;
+    }
+    if (pool > 0) fprintf(stderr, "Warning: worker pool is incomplete\n");
+    int monitor_running = pthread_create(&monitor_thread_id, NULL, monitor_thread, NULL) == 0;
+    // Pinned only now, otherwise the pool would inherit the dispatcher's single CPU
+    if (dispatcher_cpu >= 0) {
+        if (pin_to_cpu(dispatcher_cpu) != 0) {
+            fprintf(stderr, "Warning: could not pin dispatcher to cpu %d\n", dispatcher_cpu);
+            dispatcher_cpu = -1;
+        } else {
+            char cpu_str[16];
+            snprintf(cpu_str, sizeof(cpu_str), "%d", dispatcher_cpu);
+            write_log("dispatcher.txt", "TIME %lld: dispatcher affinity cpu %s\n", getCurrentTimeMs(), cpu_str);
+        }
+    }
+    if (daemon_mode) {
+        // The dispatcher keeps them blocked, daemon_wait_readable() lets them
+        // in only while it waits for input
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = daemon_signal_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        pthread_sigmask(SIG_BLOCK, NULL, &daemon_wait_mask);
+        sigdelset(&daemon_wait_mask, SIGINT);
+        sigdelset(&daemon_wait_mask, SIGTERM);
+        // Batches are appended, start from an empty file
+        FILE* f = fopen("stats.txt", "w");
+        if (f) fclose(f);
+    }
     parsingCommandFile(cmdfile);
+    if (virtual_time) sim_wait_all();
 
     // Shutdown
-    pthread_mutex_lock(&queue_mutex);
+    profiled_lock(&queue_mutex, LOCK_QUEUE);
     while (work_queue->size > 0 || active_workers > 0) {
         pthread_cond_wait(&all_jobs_finished, &queue_mutex);
     }
-    shutdown_flag = 1;
+    __atomic_store_n(&shutdown_flag, 1, __ATOMIC_SEQ_CST);
     pthread_cond_broadcast(&queue_not_empty); 
     pthread_mutex_unlock(&queue_mutex);
+    if (wait_strategy == WAIT_SPIN) {
+        __atomic_add_fetch(&queue_futex, 1, __ATOMIC_SEQ_CST);
+        futex(&queue_futex, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
 
     // Write stats
-    FILE* statf = fopen("stats.txt", "w");
+    FILE* statf = fopen("stats.txt", daemon_mode ? "a" : "w");
     if(statf) {
-        long long total_run = getCurrentTimeMs() - start_time_global;
-        double avg = (total_jobs_done > 0) ? (double)sum_turnaround / total_jobs_done : 0.0;
-        
-        fprintf(statf, "total running time: %lld milliseconds\n", total_run);
-        fprintf(statf, "sum of jobs turnaround time: %lld milliseconds\n", sum_turnaround);
-        fprintf(statf, "min job turnaround time: %lld milliseconds\n", (min_turnaround == -1 ? 0 : min_turnaround));
-        fprintf(statf, "average job turnaround time: %f milliseconds\n", avg);
-        fprintf(statf, "max job turnaround time: %lld milliseconds\n", max_turnaround);
+        long long total_run = dispatcherTimeMs() - start_time_global;
+        if (daemon_mode) fprintf(statf, "total: %lld jobs in %d batches\n", total_jobs_done, batch_number);
+        write_turnaround_stats(statf, total_run, sum_turnaround, min_turnaround, max_turnaround, total_jobs_done);
+        write_latency_stats(statf, num_threads);
+        write_pool_stats(statf, num_threads);
         fclose(statf);
     }
+    if (monitor_running) {
+        __atomic_store_n(&monitor_stop, 1, __ATOMIC_RELEASE);
+        pthread_kill(monitor_thread_id, SIGUSR1);
+        pthread_join(monitor_thread_id, NULL);
+    }
+
     //added: Free allocated memory and destroy mutexes/conds
     // 1. Wait for all threads to actually finish (Join)
     for (int i = 0; i < num_threads; i++) {
-        pthread_join(worker_thread_pool[i], NULL);
+        if (workers[i].created) pthread_join(worker_thread_pool[i], NULL);
+    }
+
+    if (lock_profile) {
+        long long contended, wait_ns;
+        merge_lock_stats(&contended, &wait_ns);
+        write_lock_report(num_threads, contended, wait_ns);
     }
 
     // 2. Free the arrays we allocated
     free(worker_thread_pool);
     free(tid);
+    free(workers);
+    free(sim_heap);
+    pthread_attr_destroy(&worker_attr);
     
     // 3. Free the queue struct itself
     free(work_queue);
@@ -397,29 +1562,113 @@ int dispatcher(FILE* cmdfile, int num_threads, int num_counters, int log_mode){
 }
 
 
+// Optional flags after the four positional arguments, "--name=value"
+int parse_option(const char* opt) {
+    if (strncmp(opt, "--stack-kb=", 11) == 0) {
+        long kb = atol(opt + 11);
+        if (kb <= 0 || kb > MAX_STACK_KB) return -1;
+        stack_kb = (size_t)kb;
+    } else if (strncmp(opt, "--spawners=", 11) == 0) {
+        num_spawners = atoi(opt + 11);
+        if (num_spawners <= 0) return -1;
+    } else if (strcmp(opt, "--pin=compact") == 0) {
+        worker_pin = PIN_COMPACT;
+    } else if (strcmp(opt, "--pin=scatter") == 0) {
+        worker_pin = PIN_SCATTER;
+    } else if (strncmp(opt, "--cpus=", 7) == 0) {
+        cpu_list_arg = opt + 7;
+        if (parse_cpu_list(cpu_list_arg) != 0) return -1;
+        if (worker_pin == PIN_NONE) worker_pin = PIN_COMPACT;
+    } else if (strcmp(opt, "--wait=cond") == 0) {
+        wait_strategy = WAIT_COND;
+    } else if (strcmp(opt, "--wait=spin") == 0) {
+        wait_strategy = WAIT_SPIN;
+    } else if (strncmp(opt, "--spin=", 7) == 0) {
+        spin_max = atoi(opt + 7);
+        if (spin_max < SPIN_MIN) return -1;
+        wait_strategy = WAIT_SPIN;
+    } else if (strncmp(opt, "--scanner=", 10) == 0) {
+        scanner_arg = opt + 10;
+    } else if (strcmp(opt, "--parse-bench") == 0) {
+        parse_bench = 1;
+    } else if (strcmp(opt, "--daemon") == 0) {
+        daemon_mode = 1;
+    } else if (strcmp(opt, "--virtual-time") == 0) {
+        virtual_time = 1;
+    } else if (strcmp(opt, "--lock-profile") == 0) {
+        lock_profile = 1;
+    } else if (strncmp(opt, "--pin-dispatcher=", 17) == 0) {
+        dispatcher_cpu = atoi(opt + 17);
+        if (dispatcher_cpu < 0 || dispatcher_cpu >= CPU_SETSIZE) return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char* prog) {
+    printf("Usage: %s cmdfile num_threads num_counters log_enabled [options]\n", prog);
+    printf("  cmdfile - reads commands from stdin\n");
+    printf("  --daemon        keep running past EOF of a FIFO, stats per dispatcher_wait batch;\n");
+    printf("                  SIGINT/SIGTERM stop it\n");
+    printf("  --stack-kb=N    worker stack size in KB (default %d, max %d)\n", DEFAULT_STACK_KB, MAX_STACK_KB);
+    printf("  --spawners=N    threads creating the pool in parallel (default: online CPUs)\n");
+    printf("  --pin=MODE      pin workers, MODE is compact or scatter\n");
+    printf("  --cpus=LIST     CPUs for the workers, e.g. 0-3,8 (default: all allowed CPUs)\n");
+    printf("  --pin-dispatcher=CPU  pin the dispatcher, workers avoid that CPU\n");
+    printf("  --lock-profile  write per-lock contention to locks.txt\n");
+    printf("  --virtual-time  simulate the workers, sleeps advance a virtual clock\n");
+    printf("  --wait=MODE     idle workers: cond (default) or spin (spin, then park on a futex)\n");
+    printf("  --spin=N        max pause loops before parking (default %d, implies --wait=spin)\n", DEFAULT_SPIN_MAX);
+    printf("  --scanner=NAME  cmdfile line scanner: auto (default), avx2, sse2 or scalar\n");
+    printf("  --parse-bench   only measure cmdfile scanning speed (GB/s) and exit\n");
+    printf("While running, SIGUSR1 writes a live snapshot to %s\n", METRICS_FILE);
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        printf("Usage: %s cmdfile num_threads num_counters log_enabled\n", argv[0]);
+    if (argc < 5) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 5; i < argc; i++) {
+        if (parse_option(argv[i]) != 0) {
+            fprintf(stderr, "Error: bad option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (select_scanner(scanner_arg) != 0) {
+        fprintf(stderr, "Error: scanner %s is not available\n", scanner_arg);
         return EXIT_FAILURE;
     }
     start_time_global = getCurrentTimeMs();
     
-    FILE* cmdfile = fopen(argv[1], "r");
+    cmdfile_path = argv[1];
+    FILE* cmdfile = (strcmp(argv[1], "-") == 0) ? stdin : fopen(argv[1], "r");
     if (cmdfile == NULL) {
         perror("Error opening cmdfile");
         return EXIT_FAILURE;
     }
     int num_threads = atoi(argv[2]);
     int num_counters = atoi(argv[3]);
+    if (num_threads < 1 || num_threads > MAX_THREADS || num_counters < 0 || num_counters > MAX_COUNTERS) {
+        fprintf(stderr, "Error: num_threads must be 1..%d and num_counters 0..%d\n", MAX_THREADS, MAX_COUNTERS);
+        return EXIT_FAILURE;
+    }
     int log_mode = atoi(argv[4]);
     global_log_mode = log_mode;
+    if (parse_bench) {
+        int rc = run_parse_bench(cmdfile);
+        fclose(cmdfile);
+        return rc == 0 ? 0 : EXIT_FAILURE;
+    }
     
     pthread_mutex_init(&queue_mutex, NULL);
     pthread_cond_init(&queue_not_empty, NULL);
     pthread_cond_init(&all_jobs_finished, NULL);
     
-    dispatcher(cmdfile, num_threads, num_counters, log_mode);
+    int rc = dispatcher(cmdfile, num_threads, num_counters, log_mode);
     
-    fclose(cmdfile);
-    return 0;
+    if (cmdfile != stdin) fclose(cmdfile);
+    return rc == 0 ? 0 : EXIT_FAILURE;
 }
\ No newline at end of file
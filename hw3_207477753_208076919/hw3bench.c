@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "hw3proto.h"
+#include "hw3hist.h"
+
+// Load generator for hw3server: opens many framed connections from one
+// process, sends timestamped broadcasts and whispers at a fixed rate and
+// reports delivery latency percentiles as one CSV row.
+
+#define MAX_EVENTS 1024
+#define BUFFER_SIZE 1024
+#define DRAIN_MS 2000           // wait for stragglers after the last send
+#define CSV_HEADER "label,clients,rate,duration_s,size,whisper_pct," \
+                   "bcast_sent,bcast_expected,bcast_recv,bcast_p50_us,bcast_p90_us,bcast_p99_us,bcast_p999_us,bcast_max_us," \
+                   "whisper_sent,whisper_recv,whisper_p50_us,whisper_p90_us,whisper_p99_us,whisper_p999_us,whisper_max_us," \
+                   "deliveries_per_sec,connect_ms\n"
+
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+typedef struct conn_t {
+    int fd;
+    int ready;        // PONG for the handshake ping came back
+    char *in_buf;
+    size_t in_len;
+    size_t in_cap;
+    char *out_buf;    // bytes the socket did not take yet
+    size_t out_len;
+    size_t out_cap;
+    int want_write;
+} conn;
+
+// --- CONFIGURATION ---
+const char *host = NULL;
+int port = 0;
+int num_clients = 100;
+double rate = 1000;           // messages per second, all senders together
+double duration_s = 5;
+int msg_size = 64;            // payload bytes including the timestamp
+int whisper_pct = 0;          // share of messages sent as whispers
+const char *label = "";       // free text copied into the CSV, e.g. the server flags
+const char *prefix = "bench";
+const char *out_path = NULL;
+
+conn *conns = NULL;
+int epoll_fd = -1;
+int num_ready = 0;
+long long send_start_us = LLONG_MAX; // older messages, e.g. --history replay, are not ours
+
+unsigned long long bcast_hist[LAT_BUCKETS];
+unsigned long long whisper_hist[LAT_BUCKETS];
+unsigned long long bcast_recv = 0, whisper_recv = 0;
+long long bcast_max = 0, whisper_max = 0;
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// --- CSV ---
+// Quoted when it holds a comma, quote or newline, embedded quotes doubled
+void write_csv_field(FILE *out, const char *text) {
+    if (!strpbrk(text, ",\"\r\n")) {
+        fputs(text, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char *p = text; *p; p++) {
+        if (*p == '"') fputc('"', out);
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// --- CONNECTIONS ---
+void set_events(conn *c, int want_write) {
+    if (c->want_write == want_write) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) error("epoll_ctl");
+    c->want_write = want_write;
+}
+
+void flush_conn(conn *c) {
+    size_t off = 0;
+    while (off < c->out_len) {
+        ssize_t n = write(c->fd, c->out_buf + off, c->out_len - off);
+        if (n > 0) {
+            off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        error("write");
+    }
+    memmove(c->out_buf, c->out_buf + off, c->out_len - off);
+    c->out_len -= off;
+    set_events(c, c->out_len > 0);
+}
+
+// Frames are queued whole, so a short write never splits one on the wire
+void queue_bytes(conn *c, const void *data, size_t len) {
+    size_t need = c->out_len + len;
+    if (need > c->out_cap) {
+        size_t new_cap = c->out_cap ? c->out_cap : BUFFER_SIZE;
+        while (new_cap < need) new_cap *= 2;
+        char *grown = realloc(c->out_buf, new_cap);
+        if (!grown) error("realloc");
+        c->out_buf = grown;
+        c->out_cap = new_cap;
+    }
+    memcpy(c->out_buf + c->out_len, data, len);
+    c->out_len = need;
+}
+
+void queue_frame(conn *c, uint8_t type, const char *payload, size_t len) {
+    unsigned char hdr[H3_HEADER_LEN];
+    h3_put_header(hdr, len, type);
+    queue_bytes(c, hdr, H3_HEADER_LEN);
+    queue_bytes(c, payload, len);
+}
+
+void send_frame(conn *c, uint8_t type, const char *payload, size_t len) {
+    queue_frame(c, type, payload, len);
+    if (!c->want_write) flush_conn(c);
+}
+
+int open_conn(conn *c, const struct sockaddr_in *addr, int index) {
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) return -1;
+
+    // Magic, NAME, then a PING: the PONG proves the server has the name
+    char name[64];
+    int n = snprintf(name, sizeof(name), "%s%d", prefix, index);
+    queue_bytes(c, H3_MAGIC, H3_MAGIC_LEN);
+    queue_frame(c, H3_NAME, name, n);
+    queue_frame(c, H3_PING, "hello", 5);
+    set_events(c, 1); // sent once the connect completes
+    return 0;
+}
+
+// --- RECEIVING ---
+// Chat payloads look like "sender: T<send_us> ..." or "sender: @target T<send_us> ..."
+void record_message(const char *payload, size_t len, long long recv_us) {
+    const char *p = memchr(payload, ':', len);
+    if (!p) return;
+    const char *end = payload + len;
+    p += 2;
+    int whisper = p < end && *p == '@';
+    if (whisper) {
+        p = memchr(p, ' ', end - p);
+        if (!p) return;
+        p++;
+    }
+    if (p >= end || *p != 'T') return;
+    long long sent_us = strtoll(p + 1, NULL, 10);
+    if (sent_us < send_start_us) return;
+    long long lat = recv_us - sent_us;
+    if (whisper) {
+        whisper_hist[latency_bucket(lat)]++;
+        whisper_recv++;
+        if (lat > whisper_max) whisper_max = lat;
+    } else {
+        bcast_hist[latency_bucket(lat)]++;
+        bcast_recv++;
+        if (lat > bcast_max) bcast_max = lat;
+    }
+}
+
+void read_conn(conn *c) {
+    long long t = now_us();
+    while (1) {
+        if (c->in_len == c->in_cap) {
+            size_t new_cap = c->in_cap ? c->in_cap * 2 : 16 * BUFFER_SIZE;
+            char *grown = realloc(c->in_buf, new_cap);
+            if (!grown) error("realloc");
+            c->in_buf = grown;
+            c->in_cap = new_cap;
+        }
+        ssize_t n = read(c->fd, c->in_buf + c->in_len, c->in_cap - c->in_len);
+        if (n == 0) {
+            fprintf(stderr, "Error: server closed a connection\n");
+            exit(1);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            error("read");
+        }
+        c->in_len += n;
+
+        size_t pos = 0;
+        while (c->in_len - pos >= H3_HEADER_LEN) {
+            const unsigned char *hdr = (const unsigned char *)c->in_buf + pos;
+            uint32_t len = h3_get_len(hdr);
+            if (c->in_len - pos < H3_HEADER_LEN + len) break;
+            const char *payload = c->in_buf + pos + H3_HEADER_LEN;
+            if (h3_get_type(hdr) == H3_MSG) {
+                record_message(payload, len, t);
+            } else if (h3_get_type(hdr) == H3_PONG && !c->ready) {
+                c->ready = 1;
+                num_ready++;
+            } else if (h3_get_type(hdr) == H3_PING) {
+                send_frame(c, H3_PONG, payload, len);
+            }
+            pos += H3_HEADER_LEN + len;
+        }
+        memmove(c->in_buf, c->in_buf + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+}
+
+void poll_once(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return;
+        error("epoll_wait");
+    }
+    for (int i = 0; i < n; i++) {
+        conn *c = events[i].data.ptr;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            fprintf(stderr, "Error: connection to server failed\n");
+            exit(1);
+        }
+        if (events[i].events & EPOLLOUT) flush_conn(c);
+        if (events[i].events & EPOLLIN) read_conn(c);
+    }
+}
+
+// --- SENDING ---
+void send_one(unsigned long long seq, unsigned long long *bcasts, unsigned long long *whispers) {
+    char payload[H3_MAX_PAYLOAD];
+    int sender = rand() % num_clients;
+    int len;
+    if (whisper_pct > 0 && rand() % 100 < whisper_pct) {
+        len = snprintf(payload, sizeof(payload), "@%s%d T%lld %llu ", prefix, rand() % num_clients, now_us(), seq);
+        (*whispers)++;
+    } else {
+        len = snprintf(payload, sizeof(payload), "T%lld %llu ", now_us(), seq);
+        (*bcasts)++;
+    }
+    // Pad up to the requested size
+    while (len < msg_size && len < (int)sizeof(payload)) payload[len++] = 'x';
+    send_frame(&conns[sender], H3_MSG, payload, len);
+}
+
+// --- OPTIONS ---
+int parse_option(const char *opt) {
+    if (strncmp(opt, "--clients=", 10) == 0) {
+        num_clients = atoi(opt + 10);
+        if (num_clients < 1) return -1;
+    } else if (strncmp(opt, "--rate=", 7) == 0) {
+        rate = atof(opt + 7);
+        if (rate <= 0) return -1;
+    } else if (strncmp(opt, "--duration=", 11) == 0) {
+        duration_s = atof(opt + 11);
+        if (duration_s <= 0) return -1;
+    } else if (strncmp(opt, "--size=", 7) == 0) {
+        msg_size = atoi(opt + 7);
+        if (msg_size < 1 || msg_size > H3_MAX_PAYLOAD) return -1;
+    } else if (strncmp(opt, "--whisper-pct=", 14) == 0) {
+        whisper_pct = atoi(opt + 14);
+        if (whisper_pct < 0 || whisper_pct > 100) return -1;
+    } else if (strncmp(opt, "--label=", 8) == 0) {
+        label = opt + 8;
+    } else if (strncmp(opt, "--prefix=", 9) == 0) {
+        prefix = opt + 9;
+    } else if (strncmp(opt, "--out=", 6) == 0) {
+        out_path = opt + 6;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <host> <port> [options]\n", prog);
+    fprintf(stderr, "  --clients=N         connections to open (default 100)\n");
+    fprintf(stderr, "  --rate=MSGS         messages per second over all clients (default 1000)\n");
+    fprintf(stderr, "  --duration=SEC      length of the send phase (default 5)\n");
+    fprintf(stderr, "  --size=BYTES        payload size, at least the timestamp (default 64)\n");
+    fprintf(stderr, "  --whisper-pct=P     percent of messages sent as whispers (default 0)\n");
+    fprintf(stderr, "  --label=TEXT        first CSV column, e.g. the server flags under test\n");
+    fprintf(stderr, "  --prefix=NAME       client names are NAME0..NAME<N-1> (default bench)\n");
+    fprintf(stderr, "  --out=FILE          append the CSV row to FILE instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, NULL); // Disable output buffering
+    if (argc < 3) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    host = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (parse_option(argv[i]) != 0) {
+            fprintf(stderr, "Error: bad option %s\n", argv[i]);
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+
+    // Thousands of sockets need more than the default 1024 fds
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct hostent *server = gethostbyname(host);
+    if (server == NULL) {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(1);
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    addr.sin_port = htons(port);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) error("epoll_create1");
+    conns = calloc(num_clients, sizeof(conn));
+    if (!conns) error("calloc");
+
+    // --- CONNECT PHASE ---
+    long long t0 = now_us();
+    for (int i = 0; i < num_clients; i++) {
+        if (open_conn(&conns[i], &addr, i) < 0) error("connect");
+        // Keep the server's accept queue from overflowing
+        if (i % 256 == 255) poll_once(0);
+    }
+    while (num_ready < num_clients) {
+        poll_once(100);
+        if (now_us() - t0 > 60 * 1000000LL) {
+            fprintf(stderr, "Error: only %d of %d clients finished the handshake\n", num_ready, num_clients);
+            exit(1);
+        }
+    }
+    long long connect_ms = (now_us() - t0) / 1000;
+    fprintf(stderr, "%d clients connected in %lld ms\n", num_clients, connect_ms);
+
+    // --- SEND PHASE ---
+    // Paced against the clock, so a slow server shows up as latency, not as a lower rate
+    unsigned long long sent = 0, bcasts = 0, whispers = 0;
+    long long start = now_us();
+    long long end = start + (long long)(duration_s * 1000000);
+    send_start_us = start;
+    while (1) {
+        long long t = now_us();
+        if (t >= end) break;
+        unsigned long long due = (unsigned long long)((t - start) * rate / 1000000.0);
+        while (sent < due) send_one(sent++, &bcasts, &whispers);
+        poll_once(1);
+    }
+    long long send_us = now_us() - start;
+
+    // --- DRAIN PHASE ---
+    unsigned long long expected = bcasts * num_clients;
+    long long drain_end = now_us() + DRAIN_MS * 1000LL;
+    while (now_us() < drain_end && (bcast_recv < expected || whisper_recv < whispers)) poll_once(10);
+
+    // --- REPORT ---
+    FILE *out = stdout;
+    if (out_path) {
+        out = fopen(out_path, "a");
+        if (!out) error("Error opening output file");
+        if (ftell(out) == 0) fputs(CSV_HEADER, out);
+    } else {
+        fputs(CSV_HEADER, out);
+    }
+    write_csv_field(out, label);
+    fprintf(out, ",%d,%.0f,%.1f,%d,%d,", num_clients, rate, duration_s, msg_size, whisper_pct);
+    fprintf(out, "%llu,%llu,%llu,%lld,%lld,%lld,%lld,%lld,", bcasts, expected, bcast_recv,
+            hist_percentile(bcast_hist, bcast_recv, 50, bcast_max), hist_percentile(bcast_hist, bcast_recv, 90, bcast_max),
+            hist_percentile(bcast_hist, bcast_recv, 99, bcast_max), hist_percentile(bcast_hist, bcast_recv, 99.9, bcast_max), bcast_max);
+    fprintf(out, "%llu,%llu,%lld,%lld,%lld,%lld,%lld,", whispers, whisper_recv,
+            hist_percentile(whisper_hist, whisper_recv, 50, whisper_max), hist_percentile(whisper_hist, whisper_recv, 90, whisper_max),
+            hist_percentile(whisper_hist, whisper_recv, 99, whisper_max), hist_percentile(whisper_hist, whisper_recv, 99.9, whisper_max), whisper_max);
+    fprintf(out, "%.0f,%lld\n", (bcast_recv + whisper_recv) * 1000000.0 / (send_us > 0 ? send_us : 1), connect_ms);
+    if (out != stdout) fclose(out);
+    return 0;
+}
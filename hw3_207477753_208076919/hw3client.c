@@ -1,31 +1,227 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h> 
 #include <sys/select.h>
+#include "hw3proto.h"
 
 #define BUFFER_SIZE 1024
+#define SCRIPT_CHUNK (64 * 1024)   // bytes of script batched into one write
+#define DEFAULT_LINGER_MS 1000     // keep reading this long after the last send
 
 void error(const char *msg) {
     perror(msg);
     exit(1);
 }
 
+int timestamps = 0;      // prefix received messages with seconds since start
+long long start_us = 0;
+long long received = 0;
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// One received message, without its newline
+void print_message(const char *msg, size_t len) {
+    if (timestamps) printf("[%.6f] ", (now_us() - start_us) / 1e6);
+    printf("%.*s\n", (int)len, msg);
+    received++;
+}
+
+// Writes all of buf to the blocking socket. A short write would leave half
+// a frame in the stream, so a failure ends the client.
+void write_all(int sockfd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(sockfd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) error("ERROR writing to socket");
+        buf += n;
+        len -= n;
+    }
+}
+
+// Sends one frame, header and payload in a single write
+void send_frame(int sockfd, uint8_t type, const char *payload, size_t len) {
+    char frame[H3_HEADER_LEN + BUFFER_SIZE];
+    if (len > BUFFER_SIZE) len = BUFFER_SIZE;
+    h3_put_header((unsigned char *)frame, len, type);
+    memcpy(frame + H3_HEADER_LEN, payload, len);
+    write_all(sockfd, frame, H3_HEADER_LEN + len);
+}
+
+// Prints every complete frame in buf, answers PINGs, and returns the bytes used
+size_t handle_frames(int sockfd, const char *buf, size_t len) {
+    size_t pos = 0;
+    while (len - pos >= H3_HEADER_LEN) {
+        const unsigned char *hdr = (const unsigned char *)buf + pos;
+        uint32_t plen = h3_get_len(hdr);
+        if (plen > H3_MAX_PAYLOAD) {
+            fprintf(stderr, "ERROR, bad frame from server\n");
+            exit(1);
+        }
+        if (len - pos < H3_HEADER_LEN + plen) break;
+        const char *payload = buf + pos + H3_HEADER_LEN;
+        if (h3_get_type(hdr) == H3_MSG) print_message(payload, plen);
+        else if (h3_get_type(hdr) == H3_PING) send_frame(sockfd, H3_PONG, payload, plen);
+        pos += H3_HEADER_LEN + plen;
+    }
+    return pos;
+}
+
+// --- SCRIPTED MODE ---
+// Replays messages from in, one per line, without waiting for the user.
+// Lines are batched into large writes, optionally paced to rate messages
+// per second, while everything received is printed as it arrives.
+void run_script(int sockfd, FILE *in, int framed, double rate, int linger_ms) {
+    static char out_buf[SCRIPT_CHUNK + H3_HEADER_LEN + H3_MAX_PAYLOAD + 1];
+    static char in_buf[H3_HEADER_LEN + H3_MAX_PAYLOAD];
+    size_t out_len = 0, in_len = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    long long sent = 0;
+    int eof = 0;
+
+    // The socket must never stall the reader side
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+    setvbuf(in, NULL, _IOFBF, 1 << 20);
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    long long begin = now_us();
+    long long done_at = 0;
+    while (1) {
+        long long t = now_us();
+        // Refill the batch with as many lines as the rate allows
+        long long due = rate > 0 ? (long long)((t - begin) * rate / 1e6) + 1 : -1;
+        while (!eof && out_len < SCRIPT_CHUNK && (due < 0 || sent < due)) {
+            ssize_t n = getline(&line, &line_cap, in);
+            if (n < 0) {
+                eof = 1;
+                break;
+            }
+            if (n > 0 && line[n - 1] == '\n') n--;
+            if (n == 0) continue;
+            if (n > H3_MAX_PAYLOAD) n = H3_MAX_PAYLOAD;
+            if (framed) {
+                h3_put_header((unsigned char *)out_buf + out_len, n, H3_MSG);
+                out_len += H3_HEADER_LEN;
+            }
+            memcpy(out_buf + out_len, line, n);
+            out_len += n;
+            if (!framed) out_buf[out_len++] = '\n';
+            sent++;
+            if (n >= 5 && strncmp(line, "!exit", 5) == 0) eof = 1;
+        }
+        if (eof && out_len == 0 && done_at == 0) {
+            done_at = t;
+            fprintf(stderr, "sent %lld messages in %.3f s\n", sent, (t - begin) / 1e6);
+        }
+        if (done_at && t - done_at >= linger_ms * 1000LL) break;
+
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(sockfd, &readfds);
+        if (out_len > 0) FD_SET(sockfd, &writefds);
+        // Wake up for the next paced send, or to end the linger period
+        struct timeval tv = {0, 1000};
+        if (eof && out_len == 0) tv.tv_usec = 10000;
+        if (select(sockfd + 1, &readfds, &writefds, NULL, &tv) < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR in select");
+        }
+
+        if (FD_ISSET(sockfd, &writefds)) {
+            ssize_t n = write(sockfd, out_buf, out_len);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) error("ERROR writing to socket");
+            if (n > 0) {
+                memmove(out_buf, out_buf + n, out_len - n);
+                out_len -= n;
+            }
+        }
+        if (FD_ISSET(sockfd, &readfds)) {
+            ssize_t n = read(sockfd, in_buf + in_len, sizeof(in_buf) - in_len);
+            if (n == 0) {
+                printf("Server disconnected.\n");
+                break;
+            }
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) continue;
+                error("ERROR reading from socket");
+            }
+            in_len += n;
+            size_t used = 0;
+            if (framed) {
+                used = handle_frames(sockfd, in_buf, in_len);
+            } else {
+                // Legacy messages end with a newline, keep any partial tail
+                char *nl;
+                while ((nl = memchr(in_buf + used, '\n', in_len - used)) != NULL) {
+                    print_message(in_buf + used, nl - (in_buf + used));
+                    used = nl - in_buf + 1;
+                }
+                if (used == 0 && in_len == sizeof(in_buf)) used = in_len;
+            }
+            memmove(in_buf, in_buf + used, in_len - used);
+            in_len -= used;
+        }
+    }
+    fflush(stdout);
+    fprintf(stderr, "received %lld messages\n", received);
+    free(line);
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <host> <port> <name> [options]\n", prog);
+    fprintf(stderr, "  --framed          length-prefixed frames instead of newline text\n");
+    fprintf(stderr, "  --script=FILE|-   send FILE (or stdin) line by line without prompting, then exit\n");
+    fprintf(stderr, "  --rate=N          script mode: at most N messages per second (default unlimited)\n");
+    fprintf(stderr, "  --linger=MS       script mode: keep reading MS milliseconds after the last send (default %d)\n", DEFAULT_LINGER_MS);
+    fprintf(stderr, "  --timestamps      prefix received messages with seconds since start\n");
+}
+
 int main(int argc, char *argv[]) {
     setbuf(stdout, NULL); // Disable output buffering
-    // Check syntax hw3client addr port name
+    // Check syntax hw3client addr port name [options]
     if (argc < 4) {
-        fprintf(stderr, "Usage: %s <host> <port> <name>\n", argv[0]);
+        print_usage(argv[0]);
         exit(1);
     }
 
     char *hostname = argv[1];
     int port = atoi(argv[2]);
     char *name = argv[3];
+    int framed = 0; // length-prefixed frames from hw3proto.h instead of raw text
+    const char *script = NULL;
+    double rate = 0;
+    int linger_ms = DEFAULT_LINGER_MS;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--framed") == 0) {
+            framed = 1;
+        } else if (strncmp(argv[i], "--script=", 9) == 0) {
+            script = argv[i] + 9;
+        } else if (strncmp(argv[i], "--rate=", 7) == 0) {
+            rate = atof(argv[i] + 7);
+        } else if (strncmp(argv[i], "--linger=", 9) == 0) {
+            linger_ms = atoi(argv[i] + 9);
+        } else if (strcmp(argv[i], "--timestamps") == 0) {
+            timestamps = 1;
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    start_us = now_us();
 
     int sockfd;
     struct sockaddr_in server_addr;
@@ -53,7 +249,30 @@ int main(int argc, char *argv[]) {
         error("ERROR connecting");
 
     // Handshake: Notify server of our name
-    write(sockfd, name, strlen(name));
+    if (framed) {
+        write_all(sockfd, H3_MAGIC, H3_MAGIC_LEN);
+        send_frame(sockfd, H3_NAME, name, strlen(name));
+    } else if (script) {
+        // The script follows at once and may share the name's segment, so end the name with a newline
+        char line[BUFFER_SIZE + 2];
+        int n = snprintf(line, sizeof(line), "%s\n", name);
+        if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+        write_all(sockfd, line, n);
+    } else {
+        write_all(sockfd, name, strlen(name));
+    }
+
+    // Framed mode: bytes received but not yet a whole frame
+    static char frame_buf[H3_HEADER_LEN + H3_MAX_PAYLOAD];
+    size_t frame_len = 0;
+
+    if (script) {
+        FILE *in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+        if (!in) error("ERROR opening script");
+        run_script(sockfd, in, framed, rate, linger_ms);
+        close(sockfd);
+        return 0;
+    }
 
     // Main Loop: Monitor Stdin (User) and Socket (Server)
     fd_set readfds;
@@ -71,14 +290,23 @@ int main(int argc, char *argv[]) {
         if (FD_ISSET(sockfd, &readfds)) {
             char buffer[BUFFER_SIZE];
             memset(buffer, 0, BUFFER_SIZE);
-            int n = read(sockfd, buffer, BUFFER_SIZE - 1);
+            int n = framed ? read(sockfd, frame_buf + frame_len, sizeof(frame_buf) - frame_len)
+                           : read(sockfd, buffer, BUFFER_SIZE - 1);
             
             if (n <= 0) {
                 printf("Server disconnected.\n");
                 close(sockfd);
                 exit(0);
             }
-            printf("%s", buffer);
+            if (framed) {
+                frame_len += n;
+                size_t used = handle_frames(sockfd, frame_buf, frame_len);
+                memmove(frame_buf, frame_buf + used, frame_len - used);
+                frame_len -= used;
+            } else {
+                if (timestamps) printf("[%.6f] ", (now_us() - start_us) / 1e6);
+                printf("%s", buffer);
+            }
             fflush(stdout); 
         }
 
@@ -88,16 +316,22 @@ int main(int argc, char *argv[]) {
             memset(buffer, 0, BUFFER_SIZE);
             
             if (fgets(buffer, BUFFER_SIZE, stdin) != NULL) {
+                // Frames carry their own length, the newline is not part of the message
+                if (framed) buffer[strcspn(buffer, "\n")] = 0;
+                size_t len = strlen(buffer);
+
                 // Check for exit command
                 if (strncmp(buffer, "!exit", 5) == 0) {
-                    write(sockfd, buffer, strlen(buffer)); // Notify server
+                    if (framed) send_frame(sockfd, H3_MSG, buffer, len); // Notify server
+                    else write_all(sockfd, buffer, len);
                     printf("client exiting\n");
                     close(sockfd);
                     exit(0);
                 }
 
                 // Send message to server
-                write(sockfd, buffer, strlen(buffer));
+                if (framed) send_frame(sockfd, H3_MSG, buffer, len);
+                else write_all(sockfd, buffer, len);
             }
         }
     }
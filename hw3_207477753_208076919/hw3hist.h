@@ -0,0 +1,42 @@
+#ifndef HW3HIST_H
+#define HW3HIST_H
+
+#include <limits.h>
+
+// Latency histogram shared by hw3server (!stats, in ns) and hw3bench (in us).
+// Same layout as hw2: exact below LAT_EXACT, then 4 buckets per power of two.
+
+#define LAT_EXACT 4
+#define LAT_MAX_EXP 40
+#define LAT_BUCKETS (LAT_MAX_EXP * 4)
+
+static inline int latency_bucket(long long v) {
+    if (v < LAT_EXACT) return v < 0 ? 0 : (int)v;
+    int exp = 63 - __builtin_clzll((unsigned long long)v);
+    if (exp >= LAT_MAX_EXP) return LAT_BUCKETS - 1;
+    return (exp - 1) * 4 + (int)((v >> (exp - 2)) & 3);
+}
+
+static inline long long latency_bucket_max(int b) {
+    if (b < LAT_EXACT) return b;
+    if (b == LAT_BUCKETS - 1) return LLONG_MAX;
+    int exp = b / 4 + 1;
+    long long low = (long long)(4 + b % 4) << (exp - 2);
+    return low + (1LL << (exp - 2)) - 1;
+}
+
+// Upper bound of the bucket holding the p-th percentile, never above the real maximum
+static inline long long hist_percentile(const unsigned long long *hist, unsigned long long total, double p,
+                                        long long max) {
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(p * total / 100.0);
+    if (rank >= total) rank = total - 1;
+    unsigned long long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return latency_bucket_max(b) < max ? latency_bucket_max(b) : max;
+    }
+    return max;
+}
+
+#endif
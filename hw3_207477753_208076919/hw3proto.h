@@ -0,0 +1,54 @@
+#ifndef HW3PROTO_H
+#define HW3PROTO_H
+
+#include <stdint.h>
+
+// Framed hw3 protocol, shared by hw3server and hw3client.
+//
+// A framed client opens with H3_MAGIC followed by a NAME frame. Every frame
+// is a 5 byte header, a 4 byte big-endian payload length and a 1 byte type,
+// followed by the payload. Clients that do not send the magic speak the old
+// newline protocol: the name, then one message per line.
+
+#define H3_MAGIC "\0H3F"
+#define H3_MAGIC_LEN 4
+#define H3_HEADER_LEN 5
+#define H3_MAX_PAYLOAD (64 * 1024)
+
+enum {
+    H3_MSG = 1,   // chat text, client to server and server to client
+    H3_NAME = 2,  // handshake, payload is the client name
+    H3_PING = 3,  // answered with a PONG carrying the same payload
+    H3_PONG = 4,
+
+    // Server to server only, see H3_PEER_MAGIC
+    H3_HELLO = 5,     // payload is the sender's node id in decimal
+    H3_RELAY = 6,     // broadcast: room name length (1 byte), room name, message payload
+    H3_ROUTE = 7,     // whisper: target name length (1 byte), target name, message payload
+    H3_NAME_ADD = 8,  // payload is a name that just connected to the sender
+    H3_NAME_DEL = 9,  // payload is a name that left the sender
+};
+
+// Federated servers (hw3server --peer) link up by sending H3_PEER_MAGIC and
+// a HELLO frame from both ends, then exchange the server to server frames.
+// A message payload travels exactly as a client would receive it.
+#define H3_PEER_MAGIC "\0H3P"
+#define H3_PEER_MAX_PAYLOAD (H3_MAX_PAYLOAD + 4096)
+
+static inline void h3_put_header(unsigned char *hdr, uint32_t len, uint8_t type) {
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    hdr[4] = type;
+}
+
+static inline uint32_t h3_get_len(const unsigned char *hdr) {
+    return ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+}
+
+static inline uint8_t h3_get_type(const unsigned char *hdr) {
+    return hdr[4];
+}
+
+#endif
@@ -1,16 +1,63 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <netdb.h>
+#include "hw3proto.h"
+#include "hw3hist.h"
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
 
 #define MAX_CLIENTS 100
 #define BUFFER_SIZE 1024
-#define MAX_FD 1024 
+#define MAX_EVENTS 256          // epoll events handled per wakeup
+#define INITIAL_TABLE_SIZE 1024 // client table slots, doubled on demand
+#define MAX_NAME 100
+#define HANDSHAKE_MAX (H3_MAGIC_LEN + H3_HEADER_LEN + BUFFER_SIZE) // magic, NAME header, longest name
+#define MAX_THREADS 256
+#define REGISTRY_BUCKETS 1024   // initial name registry buckets, doubled on demand
+#define DEFAULT_HWM (1 << 20)   // queued output bytes allowed per client
+#define IOV_BATCH 64            // queued messages handed to one writev
+#define ROOM_BUCKETS 256        // room name hash buckets
+#define LOBBY 0                 // room id every client starts in
+#define URING_ENTRIES 1024      // submission queue size, completion queue is 4x
+#define URING_BUFS 256          // provided receive buffers per loop (power of 2)
+#define URING_BUF_SIZE 4096
+#define DEFAULT_HISTORY_BYTES (1 << 20) // ring size of the history log
+#define DEFAULT_HISTORY_REPLAY 20       // lobby messages sent to a new client
+#define HISTORY_MAX_REPLAY 1024         // one writev, so at most IOV_MAX
+#define HISTORY_DATA_OFFSET 4096        // the ring starts after a header page
+#define HISTORY_MAGIC "H3HIST1"
+#define MAX_NODES 64                    // federation node ids are 0..MAX_NODES-1
+#define PEER_HWM (64 << 20)             // queued bytes before a peer link is dropped
+#define PEER_RETRY_MS 1000              // redial interval for links that are down
+#define STATS_MAX_CLIENTS 50            // clients listed per loop by !stats
+#define TIMER_TICK_MS 100               // timer wheel resolution
+#define WHEEL_BITS 6                    // 64 slots per level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4                  // 64^4 ticks, about 19 days at 100 ms
 
 // Helper function to handle  errors and exit
 void error(const char *msg) {
@@ -18,149 +65,2544 @@ void error(const char *msg) {
     exit(1);
 }
 
-// Global array to map Socket File Descriptors to Client Names
-// Index = Socket FD, Value = Name String
-char *client_names[MAX_FD];
+// Immutable formatted message, shared by every loop that delivers it.
+// Stored once as [frame header][payload]['\n']: framed clients are sent all
+// but the newline, legacy clients all but the header.
+typedef struct msg_buf_t {
+    int refs;   // atomic
+    int len;
+    char data[];
+} msg_buf;
 
-int main(int argc, char *argv[]) {
-    setbuf(stdout, NULL); // Disable output buffering
-    // Check command line arguments: hw3server port
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+// Token bucket, refilled lazily from the time of the last look
+typedef struct token_bucket_t {
+    double tokens;
+    uint64_t last_ms;
+} token_bucket;
+
+// A connection waits for its name before it can send or receive chat.
+// A federation link we dial starts out connecting, then waits for HELLO.
+typedef enum { CONN_CONNECTING, CONN_AWAITING_NAME, CONN_ACTIVE } conn_state;
+
+// Per-connection state, owned by exactly one event loop
+typedef struct client_t {
+    int fd;
+    uint64_t id;      // never reused, tells a recycled fd apart from the old one
+    conn_state state;
+    struct in_addr addr;
+    char *name;       // NULL until the handshake is done
+    int active_index; // position in the loop's active_clients[], -1 until active
+    int framed;       // speaks hw3proto.h frames instead of newline text
+    int room;         // room id, -1 until active
+    int room_index;   // position in the loop's member array of that room
+    int peer;         // a link to another server, owned by fed_loop
+    int node;         // peer links: the other server's node id, -1 until known
+
+    // Bytes read but not yet parsed into complete messages
+    char *in_buf;
+    size_t in_len;
+    size_t in_cap;
+
+    // Output not yet accepted by the socket, flushed on EPOLLOUT. A ring of
+    // references to shared messages, never copies.
+    msg_buf **out_q;
+    int out_head;
+    int out_count;
+    int out_cap;
+    size_t out_off;   // bytes of out_q[out_head] already sent
+    size_t out_bytes; // unsent bytes in the whole queue
+    int want_write;   // EPOLLOUT is armed
+    int closing;      // closed at the end of the current batch
+    struct client_t *next_closing;
+
+    // io_uring backend: requests in flight still point at the client, so
+    // it is only freed once the last one completes
+    int inflight;
+    int send_busy;
+    int dirty;        // has output waiting for a send submission
+    struct client_t *next_dirty;
+    struct uring_send_t *send;
+
+    // Counters for !stats
+    uint64_t bytes_in;
+    uint64_t msgs_in;
+    uint64_t bytes_out;
+    uint64_t msgs_out;
+    size_t peak_queued; // most output ever queued at once
+
+    // Idle timeout and heartbeat. Input only stores last_active; the timer
+    // is not moved until it fires and finds the client was busy since.
+    uint64_t last_active; // ms, the loop's clock at the last input
+    uint64_t last_ping;   // ms, when the last heartbeat PING went out
+    uint64_t timer_expires; // wheel tick
+    struct client_t *timer_next;
+    struct client_t **timer_pprev; // NULL while not in the wheel
+
+    // Rate limits
+    token_bucket msg_tokens;
+    token_bucket byte_tokens;
+    int throttled;    // delay policy: input waits for tokens, see rate_resume()
+    int limited;      // dropping messages, told once until one gets through
+    uint64_t msgs_limited;
+    struct client_t *next_throttled;
+} client;
+
+#ifdef HAVE_IO_URING
+// Arguments of the client's one in-flight sendmsg, kept alive until it completes
+typedef struct uring_send_t {
+    struct msghdr msg;
+    struct iovec iov[IOV_BATCH];
+} uring_send;
+
+// Raw io_uring rings, mapped from the kernel
+typedef struct io_ring_t {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffer ring: the kernel picks a free buffer for each recv
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_mem;
+    unsigned short buf_tail;
+    uint64_t wake_count;   // target of the eventfd read
+    struct __kernel_timespec tick; // timer wheel tick, a TIMEOUT request
+} io_ring;
+#endif
+
+typedef enum { SLOW_DROP, SLOW_EVICT } slow_policy;
+
+// Over its rate, a message is dropped or waits in the input buffer
+typedef enum { RATE_DROP, RATE_DELAY } rate_policy;
+typedef enum { RATE_OK, RATE_DROPPED, RATE_WAIT } rate_verdict;
+
+// Tokens per second and bucket size, rate 0 means no limit
+typedef struct rate_limit_t {
+    double rate;
+    double burst;
+} rate_limit;
+
+// Cross-loop delivery request
+typedef enum { MAIL_BROADCAST, MAIL_WHISPER, MAIL_PEER, MAIL_STATS } mail_kind;
+
+typedef struct mail_t {
+    struct mail_t *next;
+    mail_kind kind;
+    msg_buf *msg;
+    int room;             // MAIL_BROADCAST only
+    int target_fd;        // MAIL_WHISPER, and the admin for MAIL_STATS
+    uint64_t target_id;
+    int target_loop;      // MAIL_STATS only: the admin's loop
+    int node;             // MAIL_PEER only, -1 for every linked node
+} mail;
+
+// Hierarchical timer wheel: level L slot s holds clients due in the tick
+// range whose level L digit is s. A level's slot is cascaded down when the
+// clock reaches it, so each client costs O(1) per insert and per tick.
+typedef struct timer_wheel_t {
+    client *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t now;           // current tick
+} timer_wheel;
+
+// Where a loop spends its time, one histogram per stage
+typedef enum { STAGE_READ, STAGE_PARSE, STAGE_FANOUT, STAGE_FLUSH, NUM_STAGES } stage;
+
+typedef struct stage_hist_t {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long long buckets[LAT_BUCKETS]; // hw3hist.h layout
+} stage_hist;
+
+// Room names are interned to small ids shared by all loops. A room is
+// never deleted, an empty one just has no members.
+typedef struct room_entry_t {
+    struct room_entry_t *next;
+    uint32_t hash;
+    int id;
+    char name[MAX_NAME];
+} room_entry;
+
+// This loop's members of one room: dense array, each client knows its index
+typedef struct room_set_t {
+    client **members;
+    int count;
+    int cap;
+} room_set;
+
+// Name registry entry: where a connected name lives
+typedef struct name_entry_t {
+    struct name_entry_t *next;
+    uint32_t hash;
+    char *name;
+    int node;         // server holding the name, node_id for our own clients
+    int loop;
+    int fd;
+    uint64_t id;
+} name_entry;
+
+// A --peer: the node we keep a link to, dialed by whichever has the lower id
+typedef struct peer_conf_t {
+    int node;
+    struct sockaddr_in addr;
+} peer_conf;
+
+// History log file: a header page, then the ring of records. Positions
+// are logical byte counts that only grow, the record at pos lives at
+// pos % cap. start and end are stored last, after the bytes they cover.
+typedef struct history_header_t {
+    char magic[8];
+    uint64_t cap;
+    uint64_t start;   // oldest record still in the ring
+    uint64_t end;     // where the next record goes
+} history_header;
+
+// Records are 8-byte aligned and never wrap: one that does not fit before
+// the end of the ring is preceded by padding (len 0) and starts at offset 0.
+typedef struct history_record_t {
+    uint32_t len;     // bytes of msg_buf data that follow, 0 for padding
+    uint32_t room;
+} history_record;
+
+// One event loop per thread: own listening socket (SO_REUSEPORT), own
+// epoll set and own clients. Other loops reach it only through the mailbox.
+typedef struct event_loop_t {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;            // eventfd, readable when mail is waiting
+    mail *mailbox;          // lock-free LIFO, pushed by any thread
+    int wake_pending;       // an eventfd write is already on its way
+
+    // Connection table, Index = Socket FD. Grows instead of refusing fds >= 1024.
+    client **clients;
+    int clients_size;
+
+    // Dense list of connected clients, so a broadcast only touches live
+    // connections. Removal swaps the last entry into the hole.
+    client **active_clients;
+    int num_active;
+    int active_size;
+
+    // Clients to close once the current event batch is done, so fan-out
+    // never sees the active list change under it
+    client *closing;
+
+    // Indexed by room id, grown when a local client joins a new room
+    room_set *rooms;
+    int rooms_size;
+
+    // Written only by this loop. !stats on another loop reads them without
+    // a lock; a count that is one message behind does not matter there.
+    stage_hist stages[NUM_STAGES];
+
+    timer_wheel wheel;
+    uint64_t now_ms;        // monotonic clock, refreshed once per wakeup
+
+    // This loop's share of the global rate limit
+    token_bucket msg_tokens;
+    token_bucket byte_tokens;
+    client *throttled;      // clients whose input waits for tokens
+
+    int uring;              // this loop runs on io_uring instead of epoll
+    client *dirty;          // io_uring: clients whose output needs a send
+#ifdef HAVE_IO_URING
+    io_ring ring;
+#endif
+} event_loop;
+
+event_loop *loops = NULL;
+int num_loops = 1;
+uint64_t next_client_id = 1; // atomic
+size_t high_water_mark = DEFAULT_HWM;
+int listen_backlog = SOMAXCONN;
+int want_uring = 0;
+slow_policy slow_clients = SLOW_DROP;
+const char *admin_name = NULL; // the one client allowed to run !stats
+uint64_t idle_timeout_ms = 0;  // 0: never
+uint64_t heartbeat_ms = 0;     // 0: no PINGs
+
+// Per client limits, and the global ones divided evenly between the loops
+rate_limit client_msgs, client_bytes, loop_msgs, loop_bytes;
+double rate_burst_sec = 1;
+rate_policy over_rate = RATE_DROP;
+int rate_limited = 0;
+
+// Broadcast history, NULL when --history is not given. Appends from any
+// loop take history_lock; history_recent holds the positions of the
+// latest lobby records, oldest first from history_recent_head.
+const char *history_path = NULL;
+size_t history_bytes = DEFAULT_HISTORY_BYTES;
+int history_replay = DEFAULT_HISTORY_REPLAY;
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+history_header *history = NULL;
+char *history_data = NULL;
+uint64_t *history_recent = NULL;
+int history_recent_head = 0;
+int history_recent_count = 0;
+
+// Global name -> connection map shared by all loops. Written only on
+// handshake and disconnect, read on every whisper.
+pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+name_entry **registry = NULL;
+uint32_t registry_size = 0;
+uint32_t registry_count = 0;
+
+pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+room_entry *room_buckets[ROOM_BUCKETS];
+room_entry **room_by_id = NULL; // id -> entry, for naming a room to other nodes
+int room_by_id_size = 0;
+int num_rooms = 0;
+
+// Federation, on when --peer-port is given. fed_loop owns every link to
+// another server; the chat loops reach it through its mailbox.
+int node_id = 0;
+int peer_port = 0;
+peer_conf peer_confs[MAX_NODES];
+int num_peer_confs = 0;
+event_loop *fed_loop = NULL;
+client *peer_links[MAX_NODES];  // fed_loop only: the one link per node, up or on its way
+
+// --- MESSAGE BUFFERS ---
+// Builds a frame of the given type whose payload is prefix followed by body
+msg_buf *msg_new(uint8_t type, const char *prefix, size_t prefix_len, const char *body, size_t body_len) {
+    size_t payload = prefix_len + body_len;
+    msg_buf *m = malloc(sizeof(msg_buf) + H3_HEADER_LEN + payload + 1);
+    if (!m) return NULL;
+    m->refs = 1;
+    m->len = H3_HEADER_LEN + payload + 1;
+    h3_put_header((unsigned char *)m->data, payload, type);
+    memcpy(m->data + H3_HEADER_LEN, prefix, prefix_len);
+    memcpy(m->data + H3_HEADER_LEN + prefix_len, body, body_len);
+    m->data[m->len - 1] = '\n';
+    return m;
+}
+
+// The bytes of m that a framed or a legacy client receives
+const char *msg_data(int framed, const msg_buf *m) {
+    return framed ? m->data : m->data + H3_HEADER_LEN;
+}
+
+size_t msg_size(int framed, const msg_buf *m) {
+    return framed ? m->len - 1 : m->len - H3_HEADER_LEN;
+}
+
+void msg_ref(msg_buf *m) {
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+}
+
+void msg_unref(msg_buf *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) free(m);
+}
+
+// --- STATS ---
+const char *stage_names[NUM_STAGES] = {"read", "parse", "fan-out", "flush"};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Costs two clock reads per sample, from the vDSO without a system call
+void stage_record(event_loop *loop, stage s, uint64_t ns) {
+    stage_hist *h = &loop->stages[s];
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+    h->buckets[latency_bucket(ns)]++;
+}
+
+// --- MAILBOXES ---
+// Producers push with a CAS on the head; the owner takes the whole list
+// with one exchange, so nobody ever waits on a lock.
+void mail_post(event_loop *loop, mail *m) {
+    mail *head = __atomic_load_n(&loop->mailbox, __ATOMIC_RELAXED);
+    do {
+        m->next = head;
+    } while (!__atomic_compare_exchange_n(&loop->mailbox, &head, m, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the first post after the owner drained pays for the syscall
+    if (__atomic_exchange_n(&loop->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0) perror("Error waking event loop");
     }
+}
 
-    int port = atoi(argv[1]);// Convert the port argument from string to integer
-    int server_sock, new_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    
-    // Initialize names array to NULL
-    for (int i = 0; i < MAX_FD; i++) client_names[i] = NULL;
+// Takes every pending mail, oldest first
+mail *mail_take_all(event_loop *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("Error reading eventfd");
+    // Cleared before the exchange, so a post racing with us wakes us again
+    __atomic_store_n(&loop->wake_pending, 0, __ATOMIC_RELEASE);
+    mail *list = __atomic_exchange_n(&loop->mailbox, NULL, __ATOMIC_ACQUIRE);
+
+    mail *ordered = NULL;
+    while (list) {
+        mail *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    return ordered;
+}
+
+// --- NAME REGISTRY ---
+// FNV-1a
+uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Caller holds the write lock
+void registry_grow(void) {
+    uint32_t new_size = registry_size ? registry_size * 2 : REGISTRY_BUCKETS;
+    name_entry **grown = calloc(new_size, sizeof(name_entry *));
+    if (!grown) return; // keep the old table, only chains get longer
+    for (uint32_t b = 0; b < registry_size; b++) {
+        name_entry *e = registry[b];
+        while (e) {
+            name_entry *next = e->next;
+            e->next = grown[e->hash & (new_size - 1)];
+            grown[e->hash & (new_size - 1)] = e;
+            e = next;
+        }
+    }
+    free(registry);
+    registry = grown;
+    registry_size = new_size;
+}
+
+// Claims name for a connection, or for a client of another node (loop -1).
+// Returns -1 if another client already has it.
+int registry_add(const char *name, int node, int loop, int fd, uint64_t id) {
+    uint32_t h = name_hash(name);
+    pthread_rwlock_wrlock(&registry_lock);
+    if (registry_count >= registry_size) registry_grow();
+    name_entry **bucket = &registry[h & (registry_size - 1)];
+    for (name_entry *e = *bucket; e; e = e->next) {
+        if (e->hash == h && strcmp(e->name, name) == 0) {
+            pthread_rwlock_unlock(&registry_lock);
+            return -1;
+        }
+    }
+    name_entry *e = malloc(sizeof(name_entry));
+    if (e) e->name = strdup(name);
+    if (!e || !e->name) {
+        free(e);
+        pthread_rwlock_unlock(&registry_lock);
+        return -1;
+    }
+    e->hash = h;
+    e->node = node;
+    e->loop = loop;
+    e->fd = fd;
+    e->id = id;
+    e->next = *bucket;
+    *bucket = e;
+    registry_count++;
+    pthread_rwlock_unlock(&registry_lock);
+    return 0;
+}
+
+// Only removes the entry if it still belongs to connection id of node
+void registry_remove(const char *name, int node, uint64_t id) {
+    uint32_t h = name_hash(name);
+    pthread_rwlock_wrlock(&registry_lock);
+    if (registry_size) {
+        for (name_entry **p = &registry[h & (registry_size - 1)]; *p; p = &(*p)->next) {
+            name_entry *e = *p;
+            if (e->hash == h && e->node == node && e->id == id && strcmp(e->name, name) == 0) {
+                *p = e->next;
+                free(e->name);
+                free(e);
+                registry_count--;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+// Forgets every name of a node whose link went down
+void registry_drop_node(int node) {
+    pthread_rwlock_wrlock(&registry_lock);
+    for (uint32_t b = 0; b < registry_size; b++) {
+        name_entry **p = &registry[b];
+        while (*p) {
+            name_entry *e = *p;
+            if (e->node != node) {
+                p = &e->next;
+                continue;
+            }
+            *p = e->next;
+            free(e->name);
+            free(e);
+            registry_count--;
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+// Copies the entry for name into out. Returns 0 when found.
+int registry_lookup(const char *name, name_entry *out) {
+    uint32_t h = name_hash(name);
+    int found = -1;
+    pthread_rwlock_rdlock(&registry_lock);
+    if (registry_size) {
+        for (name_entry *e = registry[h & (registry_size - 1)]; e; e = e->next) {
+            if (e->hash == h && strcmp(e->name, name) == 0) {
+                *out = *e;
+                found = 0;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return found;
+}
+
+// --- ROOMS ---
+// Returns the id of room name, creating it on first use
+int room_intern(const char *name) {
+    uint32_t h = name_hash(name);
+    pthread_mutex_lock(&rooms_lock);
+    room_entry *e = room_buckets[h % ROOM_BUCKETS];
+    while (e && (e->hash != h || strcmp(e->name, name) != 0)) e = e->next;
+    if (!e && (e = malloc(sizeof(room_entry))) != NULL) {
+        e->hash = h;
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        if (num_rooms == room_by_id_size) {
+            int new_size = room_by_id_size ? room_by_id_size * 2 : ROOM_BUCKETS;
+            room_entry **grown = realloc(room_by_id, new_size * sizeof(room_entry *));
+            if (!grown) {
+                free(e);
+                pthread_mutex_unlock(&rooms_lock);
+                return -1;
+            }
+            room_by_id = grown;
+            room_by_id_size = new_size;
+        }
+        e->id = num_rooms++;
+        room_by_id[e->id] = e;
+        e->next = room_buckets[h % ROOM_BUCKETS];
+        room_buckets[h % ROOM_BUCKETS] = e;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return e ? e->id : -1;
+}
+
+// Entries are never freed, so the name stays valid after the lock is dropped
+const char *room_name(int room) {
+    pthread_mutex_lock(&rooms_lock);
+    const char *name = room < num_rooms ? room_by_id[room]->name : "lobby";
+    pthread_mutex_unlock(&rooms_lock);
+    return name;
+}
+
+void room_leave(event_loop *loop, client *c) {
+    if (c->room < 0) return;
+    room_set *r = &loop->rooms[c->room];
+    client *last = r->members[--r->count];
+    r->members[c->room_index] = last;
+    last->room_index = c->room_index;
+    c->room = -1;
+}
+
+// Moves c into room, O(1) apart from the occasional array growth
+int room_join(event_loop *loop, client *c, int room) {
+    if (room >= loop->rooms_size) {
+        int new_size = loop->rooms_size ? loop->rooms_size : 16;
+        while (new_size <= room) new_size *= 2;
+        room_set *grown = realloc(loop->rooms, new_size * sizeof(room_set));
+        if (!grown) return -1;
+        memset(grown + loop->rooms_size, 0, (new_size - loop->rooms_size) * sizeof(room_set));
+        loop->rooms = grown;
+        loop->rooms_size = new_size;
+    }
+    room_set *r = &loop->rooms[room];
+    if (r->count == r->cap) {
+        int new_cap = r->cap ? r->cap * 2 : 16;
+        client **grown = realloc(r->members, new_cap * sizeof(client *));
+        if (!grown) return -1;
+        r->members = grown;
+        r->cap = new_cap;
+    }
+    room_leave(loop, c);
+    c->room = room;
+    c->room_index = r->count;
+    r->members[r->count++] = c;
+    return 0;
+}
+
+// --- TIMER WHEEL ---
+// Puts c in the slot of the lowest level where its expiry and the clock
+// agree on every higher digit, so the slot is always still ahead.
+void timer_insert(timer_wheel *w, client *c) {
+    uint64_t expires = c->timer_expires;
+    uint64_t span = 1ULL << (WHEEL_BITS * WHEEL_LEVELS);
+    if (expires <= w->now) expires = w->now + 1;
+    if (expires - w->now >= span) expires = w->now + span - 1;
+    c->timer_expires = expires;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && (expires ^ w->now) >> (WHEEL_BITS * (level + 1)) != 0) level++;
+    client **slot = &w->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    c->timer_next = *slot;
+    if (*slot) (*slot)->timer_pprev = &c->timer_next;
+    c->timer_pprev = slot;
+    *slot = c;
+}
+
+void timer_remove(client *c) {
+    if (!c->timer_pprev) return;
+    *c->timer_pprev = c->timer_next;
+    if (c->timer_next) c->timer_next->timer_pprev = c->timer_pprev;
+    c->timer_pprev = NULL;
+}
+
+// Detaches a whole slot and returns its clients
+client *timer_take_slot(timer_wheel *w, int level, int slot) {
+    client *list = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    for (client *c = list; c; c = c->timer_next) c->timer_pprev = NULL;
+    return list;
+}
+
+// Arms c to fire at deadline (ms on the loop's clock)
+void timer_arm(event_loop *loop, client *c, uint64_t deadline) {
+    timer_remove(c);
+    c->timer_expires = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_insert(&loop->wheel, c);
+}
+
+// --- RATE LIMITS ---
+// Bucket size from the rate, never less than one message
+void rate_limit_setup(rate_limit *l) {
+    l->burst = l->rate * rate_burst_sec;
+    if (l->burst < 1) l->burst = 1;
+    if (l->rate > 0) rate_limited = 1;
+}
+
+void bucket_init(token_bucket *b, const rate_limit *l, uint64_t now) {
+    b->tokens = l->burst;
+    b->last_ms = now;
+}
+
+// Adds what accrued since the last look, up to the bucket size
+void bucket_refill(token_bucket *b, const rate_limit *l, uint64_t now) {
+    b->tokens += (now - b->last_ms) * l->rate / 1000.0;
+    if (b->tokens > l->burst) b->tokens = l->burst;
+    b->last_ms = now;
+}
+
+// A cost above the bucket size is charged as a full bucket, or a big
+// message could never pass
+int bucket_has(const token_bucket *b, const rate_limit *l, double cost) {
+    if (l->rate <= 0) return 1;
+    return b->tokens >= (cost < l->burst ? cost : l->burst);
+}
+
+void bucket_take(token_bucket *b, const rate_limit *l, double cost) {
+    if (l->rate > 0) b->tokens -= cost < l->burst ? cost : l->burst;
+}
+
+// --- CONNECTION TABLE ---
+// Makes room for index fd in the loop's connection table
+void grow_client_table(event_loop *loop, int fd) {
+    if (fd < loop->clients_size) return;
+    int new_size = loop->clients_size ? loop->clients_size : INITIAL_TABLE_SIZE;
+    while (new_size <= fd) new_size *= 2;
+    client **grown = realloc(loop->clients, new_size * sizeof(client *));
+    if (!grown) error("Error growing client table");
+    memset(grown + loop->clients_size, 0, (new_size - loop->clients_size) * sizeof(client *));
+    loop->clients = grown;
+    loop->clients_size = new_size;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+client *add_client(event_loop *loop, int fd, struct in_addr addr) {
+    client *c = malloc(sizeof(client));
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->id = __atomic_fetch_add(&next_client_id, 1, __ATOMIC_RELAXED);
+    c->state = CONN_AWAITING_NAME;
+    c->addr = addr;
+    c->active_index = -1;
+    c->room = -1;
+    c->node = -1;
+    c->last_active = loop->now_ms;
+    bucket_init(&c->msg_tokens, &client_msgs, loop->now_ms);
+    bucket_init(&c->byte_tokens, &client_bytes, loop->now_ms);
+    if (idle_timeout_ms && loop != fed_loop) {
+        uint64_t first = heartbeat_ms && heartbeat_ms < idle_timeout_ms ? heartbeat_ms : idle_timeout_ms;
+        timer_arm(loop, c, loop->now_ms + first);
+    }
+    grow_client_table(loop, fd);
+    loop->clients[fd] = c;
+    return c;
+}
+
+// Handshake done: from now on c takes part in broadcasts
+void activate_client(event_loop *loop, client *c) {
+    if (loop->num_active == loop->active_size) {
+        int new_size = loop->active_size ? loop->active_size * 2 : INITIAL_TABLE_SIZE;
+        client **grown = realloc(loop->active_clients, new_size * sizeof(client *));
+        if (!grown) error("Error growing active client list");
+        loop->active_clients = grown;
+        loop->active_size = new_size;
+    }
+    c->active_index = loop->num_active;
+    loop->active_clients[loop->num_active++] = c;
+    c->state = CONN_ACTIVE;
+}
+
+void free_client(client *c);
+void peer_announce(uint8_t type, const char *name);
+void peer_down(client *c);
+
+void remove_client(event_loop *loop, client *c) {
+    if (c->name != NULL) {
+        printf("client %s disconnected\n", c->name);
+        registry_remove(c->name, node_id, c->id);
+        peer_announce(H3_NAME_DEL, c->name);
+        free(c->name);
+    }
+    if (c->peer) peer_down(c);
+    timer_remove(c);
+    if (c->throttled) {
+        for (client **p = &loop->throttled; *p; p = &(*p)->next_throttled) {
+            if (*p == c) {
+                *p = c->next_throttled;
+                break;
+            }
+        }
+    }
+    loop->clients[c->fd] = NULL;
+    if (c->active_index >= 0) {
+        client *last = loop->active_clients[--loop->num_active];
+        loop->active_clients[c->active_index] = last;
+        last->active_index = c->active_index;
+    }
+    c->active_index = -1;
+    room_leave(loop, c);
+    if (c->inflight > 0) {
+        // Ends the pending recv/send, the last completion calls free_client()
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    free_client(c);
+}
+
+void free_client(client *c) {
+    // Closing the fd also drops it from the epoll set
+    close(c->fd);
+    while (c->out_count > 0) {
+        msg_unref(c->out_q[c->out_head]);
+        c->out_head = (c->out_head + 1) % c->out_cap;
+        c->out_count--;
+    }
+    free(c->out_q);
+    free(c->in_buf);
+    free(c->send);
+    free(c);
+}
+
+// Marks c for removal at the end of the batch
+void close_later(event_loop *loop, client *c) {
+    if (c->closing) return;
+    c->closing = 1;
+    c->next_closing = loop->closing;
+    loop->closing = c;
+}
+
+void close_pending(event_loop *loop) {
+    while (loop->closing) {
+        client *c = loop->closing;
+        loop->closing = c->next_closing;
+        remove_client(loop, c);
+    }
+}
+
+// --- OUTPUT QUEUES ---
+void set_want_write(event_loop *loop, client *c, int on) {
+    if (c->want_write == on) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("Error updating client events");
+        close_later(loop, c);
+        return;
+    }
+    c->want_write = on;
+}
+
+// Drops n sent bytes from the front of the queue
+void consume_output(client *c, size_t n) {
+    c->bytes_out += n;
+    c->out_bytes -= n;
+    while (n > 0) {
+        msg_buf *m = c->out_q[c->out_head];
+        size_t left = msg_size(c->framed, m) - c->out_off;
+        if (n < left) {
+            c->out_off += n;
+            return;
+        }
+        n -= left;
+        c->out_off = 0;
+        msg_unref(m);
+        c->out_head = (c->out_head + 1) % c->out_cap;
+        c->out_count--;
+    }
+}
+
+// Writes as much queued output as the socket takes, many messages per writev
+void flush_client(event_loop *loop, client *c) {
+    uint64_t start = now_ns();
+    while (c->out_count > 0) {
+        struct iovec iov[IOV_BATCH];
+        int cnt = c->out_count < IOV_BATCH ? c->out_count : IOV_BATCH;
+        for (int k = 0; k < cnt; k++) {
+            msg_buf *m = c->out_q[(c->out_head + k) % c->out_cap];
+            iov[k].iov_base = (char *)msg_data(c->framed, m);
+            iov[k].iov_len = msg_size(c->framed, m);
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + c->out_off;
+        iov[0].iov_len -= c->out_off;
+
+        ssize_t n = writev(c->fd, iov, cnt);
+        if (n > 0) {
+            consume_output(c, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_want_write(loop, c, 1);
+            stage_record(loop, STAGE_FLUSH, now_ns() - start);
+            return;
+        }
+        close_later(loop, c);
+        return;
+    }
+    set_want_write(loop, c, 0);
+    stage_record(loop, STAGE_FLUSH, now_ns() - start);
+}
+
+// io_uring: the send is submitted with the next batch
+void mark_dirty(event_loop *loop, client *c) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    c->next_dirty = loop->dirty;
+    loop->dirty = c;
+}
+
+// Adds a reference to m at the tail of the queue
+int queue_output(client *c, msg_buf *m, size_t off) {
+    if (c->out_count == c->out_cap) {
+        int new_cap = c->out_cap ? c->out_cap * 2 : 16;
+        msg_buf **grown = malloc(new_cap * sizeof(msg_buf *));
+        if (!grown) return -1;
+        for (int k = 0; k < c->out_count; k++) grown[k] = c->out_q[(c->out_head + k) % c->out_cap];
+        free(c->out_q);
+        c->out_q = grown;
+        c->out_head = 0;
+        c->out_cap = new_cap;
+    }
+    msg_ref(m);
+    c->out_q[(c->out_head + c->out_count) % c->out_cap] = m;
+    if (c->out_count == 0) c->out_off = off;
+    c->out_count++;
+    c->out_bytes += msg_size(c->framed, m) - off;
+    if (c->out_bytes > c->peak_queued) c->peak_queued = c->out_bytes;
+    return 0;
+}
+
+// Queues m for c. A client whose backlog would pass the high-water mark
+// loses the message (drop) or the connection (evict).
+void send_to_client(event_loop *loop, client *c, msg_buf *m) {
+    if (c->closing) return;
+    size_t off = 0;
+    size_t len = msg_size(c->framed, m);
+
+    // Fast path: nothing queued, so try the socket directly. io_uring loops
+    // always queue and batch their sends instead.
+    if (c->out_count == 0 && !loop->uring) {
+        ssize_t n = write(c->fd, msg_data(c->framed, m), len);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_later(loop, c);
+            return;
+        }
+        if (n > 0) c->bytes_out += n;
+        if (n == (ssize_t)len) {
+            c->msgs_out++;
+            return;
+        }
+        if (n > 0) off = n;
+    }
+
+    if (c->out_bytes + (len - off) > high_water_mark && off == 0) {
+        if (slow_clients == SLOW_EVICT) {
+            printf("client %s evicted, %zu bytes queued\n", c->name, c->out_bytes);
+            close_later(loop, c);
+        }
+        return;
+    }
+    if (queue_output(c, m, off) < 0) {
+        close_later(loop, c);
+        return;
+    }
+    c->msgs_out++;
+    if (loop->uring) mark_dirty(loop, c);
+    else set_want_write(loop, c, 1);
+}
+
+// --- HISTORY ---
+size_t history_record_size(uint32_t len) {
+    return (sizeof(history_record) + len + 7) & ~(size_t)7;
+}
+
+history_record *history_at(uint64_t pos) {
+    return (history_record *)(history_data + pos % history->cap);
+}
+
+// Position after the record at pos, or after the padding to the ring's end
+uint64_t history_next(uint64_t pos) {
+    history_record *r = history_at(pos);
+    if (r->len == 0) return pos + (history->cap - pos % history->cap);
+    return pos + history_record_size(r->len);
+}
+
+void history_remember(uint64_t pos) {
+    if (history_replay == 0) return;
+    if (history_recent_count == history_replay) {
+        history_recent_head = (history_recent_head + 1) % history_replay;
+        history_recent_count--;
+    }
+    history_recent[(history_recent_head + history_recent_count) % history_replay] = pos;
+    history_recent_count++;
+}
+
+void history_reset(size_t cap) {
+    memset(history, 0, sizeof(*history));
+    memcpy(history->magic, HISTORY_MAGIC, sizeof(history->magic));
+    history->cap = cap;
+    history_recent_head = history_recent_count = 0;
+}
+
+// Maps the log file, creating or resizing it as needed. A file written
+// with another ring size, or damaged, starts over empty.
+void history_open(void) {
+    size_t cap = (history_bytes + 7) & ~(size_t)7;
+    size_t size = HISTORY_DATA_OFFSET + cap;
+    int fd = open(history_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) error("Error opening history file");
+    struct stat st;
+    if (fstat(fd, &st) < 0) error("Error reading history file");
+    if ((size_t)st.st_size != size && ftruncate(fd, size) < 0) error("Error sizing history file");
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) error("Error mapping history file");
+    close(fd); // the mapping keeps the file open
+
+    history = map;
+    history_data = (char *)map + HISTORY_DATA_OFFSET;
+    history_recent = calloc(history_replay > 0 ? history_replay : 1, sizeof(uint64_t));
+    if (!history_recent) error("Error allocating history index");
+    if (memcmp(history->magic, HISTORY_MAGIC, sizeof(history->magic)) != 0 || history->cap != cap ||
+        history->start > history->end || history->end - history->start > cap) {
+        history_reset(cap);
+        return;
+    }
+
+    // Rebuild the replay index from the records that survived the last run
+    for (uint64_t pos = history->start; pos < history->end; pos = history_next(pos)) {
+        history_record *r = history_at(pos);
+        if (r->len != 0 && history_record_size(r->len) > cap - pos % cap) {
+            history_reset(cap);
+            return;
+        }
+        if (r->len != 0 && r->room == LOBBY) history_remember(pos);
+    }
+}
+
+// Copies a broadcast into the ring, evicting the oldest records to make
+// room. Only memcpy under the lock; the kernel writes the dirty pages back
+// on its own, so there is no system call per message.
+void history_append(int room, const msg_buf *m) {
+    if (!history) return;
+    size_t need = history_record_size(m->len);
+    if (need > history->cap / 2) return;
+
+    pthread_mutex_lock(&history_lock);
+    uint64_t pos = history->end;
+    size_t tail = history->cap - pos % history->cap;
+    if (tail < need) pos += tail;
+    uint64_t end = pos + need;
+    while (end - history->start > history->cap) history->start = history_next(history->start);
+
+    if (pos != history->end) history_at(history->end)->len = 0;
+    history_record *r = history_at(pos);
+    r->len = m->len;
+    r->room = room;
+    memcpy(r + 1, m->data, m->len);
+    __atomic_store_n(&history->end, end, __ATOMIC_RELEASE);
+    if (room == LOBBY) history_remember(pos);
+    pthread_mutex_unlock(&history_lock);
+}
+
+// Sends a client that just joined the lobby its latest messages. The records
+// are copied out under the lock and written after it is released, so the
+// other loops' appends never wait on this client's socket. Whatever the
+// socket does not take is queued, up to the high water mark.
+void history_send(event_loop *loop, client *c) {
+    if (!history || history_recent_count == 0) return;
+    struct iovec iov[HISTORY_MAX_REPLAY];
+    msg_buf *msgs[HISTORY_MAX_REPLAY];
+    int n = 0;
+
+    pthread_mutex_lock(&history_lock);
+    for (int k = 0; k < history_recent_count; k++) {
+        uint64_t pos = history_recent[(history_recent_head + k) % history_replay];
+        if (pos < history->start) continue; // overwritten since
+        history_record *r = history_at(pos);
+        msg_buf *m = malloc(sizeof(msg_buf) + r->len);
+        if (!m) break;
+        m->refs = 1;
+        m->len = r->len;
+        memcpy(m->data, r + 1, r->len);
+        msgs[n++] = m;
+    }
+    pthread_mutex_unlock(&history_lock);
+    if (n == 0) return;
+
+    for (int k = 0; k < n; k++) {
+        iov[k].iov_base = (char *)msg_data(c->framed, msgs[k]);
+        iov[k].iov_len = msg_size(c->framed, msgs[k]);
+    }
+    ssize_t sent = writev(c->fd, iov, n);
+    int stop = 0;
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        close_later(loop, c);
+        stop = 1;
+    }
+    if (sent < 0) sent = 0;
+    c->bytes_out += sent;
+
+    // Once one is dropped, so is the rest, or the replay would have holes.
+    // One the socket took part of is always queued, or it would cut a frame.
+    int queued = 0;
+    for (int k = 0; k < n; k++) {
+        if (!stop) {
+            if ((size_t)sent >= iov[k].iov_len) {
+                sent -= iov[k].iov_len;
+                c->msgs_out++;
+            } else if (sent == 0 && c->out_bytes + iov[k].iov_len > high_water_mark) {
+                stop = 1;
+            } else if (queue_output(c, msgs[k], sent) < 0) {
+                if (sent > 0) close_later(loop, c);
+                stop = 1;
+            } else {
+                sent = 0;
+                c->msgs_out++;
+                queued = 1;
+            }
+        }
+        msg_unref(msgs[k]);
+    }
+
+    if (queued && loop->uring) mark_dirty(loop, c);
+    else if (queued) set_want_write(loop, c, 1);
+}
+
+// --- IDLE TIMEOUTS AND HEARTBEATS ---
+// c's timer went off. Work out from last_active whether it is really due:
+// close it, PING it, or just put it back for the next deadline.
+void client_timer(event_loop *loop, client *c) {
+    uint64_t now = loop->now_ms;
+    if (c->closing) return;
+    if (now - c->last_active >= idle_timeout_ms) {
+        if (c->name) printf("client %s timed out\n", c->name);
+        close_later(loop, c);
+        return;
+    }
+    uint64_t next = c->last_active + idle_timeout_ms;
+
+    // Only framed clients can answer a PING, legacy ones just time out
+    if (heartbeat_ms && c->framed && c->state == CONN_ACTIVE) {
+        uint64_t since = c->last_active > c->last_ping ? c->last_active : c->last_ping;
+        if (now - since >= heartbeat_ms) {
+            msg_buf *ping = msg_new(H3_PING, "", 0, "", 0);
+            if (ping) {
+                send_to_client(loop, c, ping);
+                msg_unref(ping);
+            }
+            c->last_ping = since = now;
+        }
+        if (since + heartbeat_ms < next) next = since + heartbeat_ms;
+    }
+    timer_arm(loop, c, next);
+}
+
+// Advances the wheel to the loop's clock, cascading and firing on the way
+void timers_run(event_loop *loop) {
+    timer_wheel *w = &loop->wheel;
+    uint64_t target = loop->now_ms / TIMER_TICK_MS;
+    if (!idle_timeout_ms) return;
+    while (w->now < target) {
+        w->now++;
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0) continue;
+            client *c = timer_take_slot(w, level, (w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+            while (c) {
+                client *next = c->timer_next;
+                timer_insert(w, c);
+                c = next;
+            }
+        }
+        client *c = timer_take_slot(w, 0, w->now & (WHEEL_SLOTS - 1));
+        while (c) {
+            client *next = c->timer_next;
+            client_timer(loop, c);
+            c = next;
+        }
+    }
+}
+
+// --- CASE 1: NEW CONNECTION ---
+// Recognises the opening bytes of a connection: H3_MAGIC and a NAME frame,
+// or a legacy plain-text name. Returns 1 with name filled in, 0 when more
+// bytes are needed and -1 for a malformed handshake.
+int parse_handshake(const char *buf, size_t len, char *name, size_t name_size, int *framed, size_t *used) {
+    if (len == 0) return 0;
+    if (buf[0] != '\0') {
+        // Legacy: the name is the whole first read, or up to a newline
+        const char *nl = memchr(buf, '\n', len);
+        size_t name_len = nl ? (size_t)(nl - buf) : len;
+        *used = nl ? name_len + 1 : len;
+        if (name_len >= name_size) name_len = name_size - 1;
+        memcpy(name, buf, name_len);
+        name[name_len] = 0;
+        name[strcspn(name, "\r")] = 0;
+        *framed = 0;
+        return 1;
+    }
+
+    size_t magic = len < H3_MAGIC_LEN ? len : H3_MAGIC_LEN;
+    if (memcmp(buf, H3_MAGIC, magic) != 0) return -1;
+    if (len < H3_MAGIC_LEN + H3_HEADER_LEN) return 0;
+    const unsigned char *hdr = (const unsigned char *)buf + H3_MAGIC_LEN;
+    uint32_t name_len = h3_get_len(hdr);
+    if (h3_get_type(hdr) != H3_NAME || name_len == 0 || name_len >= name_size) return -1;
+    if (len < H3_MAGIC_LEN + H3_HEADER_LEN + name_len) return 0;
+    memcpy(name, buf + H3_MAGIC_LEN + H3_HEADER_LEN, name_len);
+    name[name_len] = 0;
+    *used = H3_MAGIC_LEN + H3_HEADER_LEN + name_len;
+    *framed = 1;
+    return 1;
+}
+
+void peer_accepted(event_loop *loop, client *c);
+
+// Accepts everything the listener has queued, so a connection storm costs
+// one wakeup per batch instead of one per connection
+void accept_clients(event_loop *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int new_sock = accept4(loop->listen_fd, (struct sockaddr *) &client_addr, &client_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (new_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept error");
+            return;
+        }
+
+        // Edge triggered from here on: every read drains the socket.
+        // The name arrives later, through the same path as chat messages.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = new_sock;
+        client *c = add_client(loop, new_sock, client_addr.sin_addr);
+        if (!c || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, new_sock, &ev) < 0) {
+            perror("Error registering client");
+            if (c) loop->clients[new_sock] = NULL;
+            free(c);
+            close(new_sock);
+        } else if (loop == fed_loop) {
+            peer_accepted(loop, c);
+        }
+    }
+}
+
+// Runs the handshake on whatever c has sent so far. Returns the bytes it
+// used, 0 while the name is incomplete.
+size_t handle_handshake(event_loop *loop, client *c) {
+    char name_buf[BUFFER_SIZE];
+    size_t used = 0;
+    int framed = 0;
+    int done = parse_handshake(c->in_buf, c->in_len, name_buf, sizeof(name_buf), &framed, &used);
+    if (done == 0 && c->in_len < HANDSHAKE_MAX) return 0;
+    if (done != 1) {
+        close_later(loop, c);
+        return 0;
+    }
+
+    // Names are unique: a second client asking for a taken name is turned away
+    if (registry_add(name_buf, node_id, loop->id, c->fd, c->id) < 0) {
+        char reply[BUFFER_SIZE + 50];
+        int n = snprintf(reply, sizeof(reply), "server: name %s is taken", name_buf);
+        // The socket is new and empty, so the reply fits in one write. It is
+        // closed right after, a write that falls short only loses the reply.
+        msg_buf *m = msg_new(H3_MSG, reply, n, "", 0);
+        int sent = 0;
+        if (m) {
+            sent = write(c->fd, msg_data(framed, m), msg_size(framed, m)) == (ssize_t)msg_size(framed, m);
+            msg_unref(m);
+        }
+        printf("client %s rejected, name in use%s\n", name_buf, sent ? "" : " (reply not sent)");
+        close_later(loop, c);
+        return 0;
+    }
+    c->name = strdup(name_buf);
+    if (!c->name) {
+        registry_remove(name_buf, node_id, c->id);
+        close_later(loop, c);
+        return 0;
+    }
+    c->framed = framed;
+    peer_announce(H3_NAME_ADD, c->name);
+    activate_client(loop, c);
+    if (room_join(loop, c, LOBBY) < 0) {
+        close_later(loop, c);
+        return 0;
+    }
+    history_send(loop, c);
+    printf("client %s connected from %s\n", c->name, inet_ntoa(c->addr));
+    return used;
+}
+
+// --- DELIVERY ---
+// Costs the size of the room, not the number of connections
+void deliver_broadcast(event_loop *loop, int room, msg_buf *m) {
+    if (room >= loop->rooms_size) return;
+    room_set *r = &loop->rooms[room];
+    for (int j = 0; j < r->count; j++) {
+        send_to_client(loop, r->members[j], m);
+    }
+}
 
+// The fd may have been closed and reused since the lookup, so check the id
+void deliver_whisper(event_loop *loop, int fd, uint64_t id, msg_buf *m) {
+    if (fd < loop->clients_size && loop->clients[fd] != NULL && loop->clients[fd]->id == id) {
+        send_to_client(loop, loop->clients[fd], m);
+    }
+}
+
+// Hands m to another loop, which gets its own reference
+void post_mail(event_loop *target, mail_kind kind, msg_buf *m, int room, int fd, uint64_t id) {
+    mail *ml = malloc(sizeof(mail));
+    if (!ml) return;
+    msg_ref(m);
+    ml->kind = kind;
+    ml->msg = m;
+    ml->room = room;
+    ml->target_fd = fd;
+    ml->target_id = id;
+    mail_post(target, ml);
+}
+
+void peer_send(event_loop *loop, int node, msg_buf *m);
+void stats_send_clients(event_loop *loop, int admin_loop, int admin_fd, uint64_t admin_id);
+
+void handle_mail(event_loop *loop) {
+    mail *ml = mail_take_all(loop);
+    while (ml) {
+        mail *next = ml->next;
+        uint64_t start = now_ns();
+        if (ml->kind == MAIL_BROADCAST) deliver_broadcast(loop, ml->room, ml->msg);
+        else if (ml->kind == MAIL_WHISPER) deliver_whisper(loop, ml->target_fd, ml->target_id, ml->msg);
+        else if (ml->kind == MAIL_PEER) peer_send(loop, ml->node, ml->msg);
+        else stats_send_clients(loop, ml->target_loop, ml->target_fd, ml->target_id);
+        if (ml->kind != MAIL_STATS) stage_record(loop, STAGE_FANOUT, now_ns() - start);
+        if (ml->msg) msg_unref(ml->msg);
+        free(ml);
+        ml = next;
+    }
+}
+
+// --- FEDERATION ---
+// Every node links to every other one, so a relayed message is only
+// delivered locally, never forwarded again. Broadcasts go to all nodes,
+// whispers to the node that the replicated name registry says holds the
+// target. Links live on fed_loop; the other loops hand it ready-made
+// frames through its mailbox and it writes each batch with one writev.
+
+// Hands a server to server frame to fed_loop, for node or every linked node
+void peer_post(msg_buf *m, int node) {
+    mail *ml = malloc(sizeof(mail));
+    if (!ml) return;
+    msg_ref(m);
+    ml->kind = MAIL_PEER;
+    ml->msg = m;
+    ml->node = node;
+    mail_post(fed_loop, ml);
+}
+
+// NAME_ADD or NAME_DEL for one of our clients
+void peer_announce(uint8_t type, const char *name) {
+    if (!fed_loop) return;
+    msg_buf *m = msg_new(type, name, strlen(name), "", 0);
+    if (!m) return;
+    peer_post(m, -1);
+    msg_unref(m);
+}
+
+// The payload of chat message m behind a length byte and name
+msg_buf *peer_wrap(uint8_t type, const char *name, const msg_buf *m) {
+    char prefix[256];
+    size_t name_len = strlen(name);
+    if (name_len > 255) name_len = 255;
+    prefix[0] = name_len;
+    memcpy(prefix + 1, name, name_len);
+    return msg_new(type, prefix, name_len + 1, m->data + H3_HEADER_LEN, m->len - H3_HEADER_LEN - 1);
+}
+
+void peer_relay(int room, const msg_buf *m) {
+    if (!fed_loop) return;
+    msg_buf *f = peer_wrap(H3_RELAY, room_name(room), m);
+    if (!f) return;
+    peer_post(f, -1);
+    msg_unref(f);
+}
+
+void peer_route(int node, const char *name, const msg_buf *m) {
+    msg_buf *f = peer_wrap(H3_ROUTE, name, m);
+    if (!f) return;
+    peer_post(f, node);
+    msg_unref(f);
+}
+
+// Queues m on a link, written with the rest of the batch by peer_flush().
+// Dropping a frame would go unnoticed, so a link that falls too far
+// behind is dropped instead and resyncs when it is redialed.
+void peer_queue(event_loop *loop, client *c, msg_buf *m) {
+    if (c->state != CONN_ACTIVE || c->closing) return;
+    if (c->out_bytes + msg_size(1, m) > PEER_HWM) {
+        printf("node %d is not keeping up, dropping the link\n", c->node);
+        close_later(loop, c);
+        return;
+    }
+    if (queue_output(c, m, 0) < 0) {
+        close_later(loop, c);
+        return;
+    }
+    mark_dirty(loop, c);
+}
+
+void peer_send(event_loop *loop, int node, msg_buf *m) {
+    if (node >= 0) {
+        if (peer_links[node]) peer_queue(loop, peer_links[node], m);
+        return;
+    }
+    for (int k = 0; k < MAX_NODES; k++) {
+        if (peer_links[k]) peer_queue(loop, peer_links[k], m);
+    }
+}
+
+void peer_flush(event_loop *loop) {
+    while (loop->dirty) {
+        client *c = loop->dirty;
+        loop->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (!c->closing) flush_client(loop, c);
+    }
+}
+
+// Both ends open with the magic and a HELLO naming their node
+int peer_hello(client *c) {
+    char buf[H3_MAGIC_LEN + H3_HEADER_LEN + 16];
+    int len = snprintf(buf + H3_MAGIC_LEN + H3_HEADER_LEN, 16, "%d", node_id);
+    memcpy(buf, H3_PEER_MAGIC, H3_MAGIC_LEN);
+    h3_put_header((unsigned char *)buf + H3_MAGIC_LEN, len, H3_HELLO);
+    size_t total = H3_MAGIC_LEN + H3_HEADER_LEN + len;
+    // A fresh socket always has room for a few bytes
+    return write(c->fd, buf, total) == (ssize_t)total ? 0 : -1;
+}
+
+// Tells a node that just linked up about every client of ours
+void peer_send_names(event_loop *loop, client *c) {
+    pthread_rwlock_rdlock(&registry_lock);
+    for (uint32_t b = 0; b < registry_size; b++) {
+        for (name_entry *e = registry[b]; e; e = e->next) {
+            if (e->node != node_id) continue;
+            msg_buf *m = msg_new(H3_NAME_ADD, e->name, strlen(e->name), "", 0);
+            if (!m) continue;
+            peer_queue(loop, c, m);
+            msg_unref(m);
+        }
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+// The other end's HELLO. There is one link per node, so a second is refused.
+void peer_linked(event_loop *loop, client *c, const char *payload, size_t len) {
+    char text[16];
+    memcpy(text, payload, len);
+    text[len] = 0;
+    int node = atoi(text);
+    if (len == 0 || node < 0 || node >= MAX_NODES || node == node_id ||
+        (c->node >= 0 && c->node != node) || (peer_links[node] && peer_links[node] != c)) {
+        printf("refused link from node %s at %s\n", text, inet_ntoa(c->addr));
+        close_later(loop, c);
+        return;
+    }
+    c->node = node;
+    c->state = CONN_ACTIVE;
+    peer_links[node] = c;
+    printf("node %d linked from %s\n", node, inet_ntoa(c->addr));
+    peer_send_names(loop, c);
+}
+
+// Called from remove_client(): the link's names go with it
+void peer_down(client *c) {
+    if (c->node < 0 || peer_links[c->node] != c) return;
+    peer_links[c->node] = NULL;
+    if (c->state != CONN_ACTIVE) return;
+    registry_drop_node(c->node);
+    printf("node %d unlinked\n", c->node);
+}
+
+// Splits a RELAY or ROUTE payload into the name and a message for our clients
+msg_buf *peer_unwrap(const char *payload, size_t len, char *name, size_t name_size) {
+    if (len < 1) return NULL;
+    size_t name_len = (unsigned char)payload[0];
+    if (name_len + 1 > len || name_len >= name_size) return NULL;
+    memcpy(name, payload + 1, name_len);
+    name[name_len] = 0;
+    return msg_new(H3_MSG, "", 0, payload + 1 + name_len, len - 1 - name_len);
+}
+
+void peer_frame(client *c, uint8_t type, const char *payload, size_t len) {
+    char name[256];
+    name_entry target;
+    if (type == H3_RELAY) {
+        msg_buf *m = peer_unwrap(payload, len, name, sizeof(name));
+        if (!m) return;
+        int room = room_intern(name);
+        if (room >= 0) {
+            history_append(room, m);
+            for (int k = 0; k < num_loops; k++) post_mail(&loops[k], MAIL_BROADCAST, m, room, -1, 0);
+        }
+        msg_unref(m);
+    } else if (type == H3_ROUTE) {
+        msg_buf *m = peer_unwrap(payload, len, name, sizeof(name));
+        if (!m) return;
+        if (registry_lookup(name, &target) == 0 && target.node == node_id)
+            post_mail(&loops[target.loop], MAIL_WHISPER, m, -1, target.fd, target.id);
+        msg_unref(m);
+    } else if ((type == H3_NAME_ADD || type == H3_NAME_DEL) && len > 0 && len < sizeof(name)) {
+        memcpy(name, payload, len);
+        name[len] = 0;
+        // A name taken here in the meantime stays ours, whispers to it stay local
+        if (type == H3_NAME_ADD) registry_add(name, c->node, -1, -1, 0);
+        else registry_remove(name, c->node, 0);
+    }
+}
+
+// consume_input() for links: the magic and HELLO, then frames
+void consume_peer_input(event_loop *loop, client *c) {
+    size_t pos = 0;
+    if (c->state == CONN_AWAITING_NAME) {
+        size_t magic = c->in_len < H3_MAGIC_LEN ? c->in_len : H3_MAGIC_LEN;
+        if (memcmp(c->in_buf, H3_PEER_MAGIC, magic) != 0) {
+            close_later(loop, c);
+            return;
+        }
+        if (c->in_len < H3_MAGIC_LEN + H3_HEADER_LEN) return;
+        const unsigned char *hdr = (const unsigned char *)c->in_buf + H3_MAGIC_LEN;
+        uint32_t len = h3_get_len(hdr);
+        if (h3_get_type(hdr) != H3_HELLO || len >= 16) {
+            close_later(loop, c);
+            return;
+        }
+        if (c->in_len < H3_MAGIC_LEN + H3_HEADER_LEN + len) return;
+        peer_linked(loop, c, c->in_buf + H3_MAGIC_LEN + H3_HEADER_LEN, len);
+        pos = H3_MAGIC_LEN + H3_HEADER_LEN + len;
+    }
+    while (!c->closing && pos < c->in_len) {
+        const char *p = c->in_buf + pos;
+        size_t avail = c->in_len - pos;
+        if (avail < H3_HEADER_LEN) break;
+        uint32_t len = h3_get_len((const unsigned char *)p);
+        if (len > H3_PEER_MAX_PAYLOAD) {
+            printf("node %d sent an oversized frame\n", c->node);
+            close_later(loop, c);
+            return;
+        }
+        if (avail < H3_HEADER_LEN + len) break;
+        peer_frame(c, h3_get_type((const unsigned char *)p), p + H3_HEADER_LEN, len);
+        pos += H3_HEADER_LEN + len;
+    }
+    memmove(c->in_buf, c->in_buf + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+// accept_clients() on fed_loop: everything arriving there is a link
+void peer_accepted(event_loop *loop, client *c) {
+    c->peer = 1;
+    c->framed = 1;
+    if (peer_hello(c) < 0) close_later(loop, c);
+}
+
+// Starts a non-blocking connect, finished by peer_connected()
+void peer_dial(event_loop *loop, peer_conf *conf) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    if (connect(fd, (struct sockaddr *)&conf->addr, sizeof(conf->addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    client *c = add_client(loop, fd, conf->addr.sin_addr);
+    if (!c || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (c) loop->clients[fd] = NULL;
+        free(c);
+        close(fd);
+        return;
+    }
+    c->peer = 1;
+    c->framed = 1;
+    c->node = conf->node;
+    c->state = CONN_CONNECTING;
+    c->want_write = 1;
+    peer_links[conf->node] = c;
+}
+
+void peer_connected(event_loop *loop, client *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 || peer_hello(c) < 0) {
+        close_later(loop, c); // refused or unreachable, retried later
+        return;
+    }
+    c->state = CONN_AWAITING_NAME;
+    set_want_write(loop, c, 0);
+}
+
+// Of each pair of nodes the lower id dials, so every pair shares one link
+void peer_redial(event_loop *loop) {
+    for (int k = 0; k < num_peer_confs; k++) {
+        peer_conf *conf = &peer_confs[k];
+        if (conf->node > node_id && !peer_links[conf->node]) peer_dial(loop, conf);
+    }
+}
+
+// --- MESSAGE HANDLING ---
+// A line from the server itself, to one client
+void send_notice(event_loop *loop, client *c, const char *text) {
+    msg_buf *m = msg_new(H3_MSG, "server: ", 8, text, strlen(text));
+    if (!m) return;
+    send_to_client(loop, c, m);
+    msg_unref(m);
+}
+
+// "/join <room>" moves the client, "/leave" sends it back to the lobby
+void handle_command(event_loop *loop, client *c, const char *text, size_t len) {
+    char room_name[MAX_NAME] = "lobby"; // "/leave", with or without its '\r'
+    char reply[MAX_NAME + 50];
+    if (len > 6 && strncmp(text, "/join ", 6) == 0) {
+        size_t name_len = len - 6;
+        if (name_len >= sizeof(room_name)) name_len = sizeof(room_name) - 1;
+        memcpy(room_name, text + 6, name_len);
+        room_name[name_len] = 0;
+        room_name[strcspn(room_name, "\r")] = 0;
+        if (room_name[0] == 0) strcpy(room_name, "lobby");
+    }
+    int room = room_intern(room_name);
+    if (room < 0 || room_join(loop, c, room) < 0) {
+        send_notice(loop, c, "could not join room");
+        return;
+    }
+    snprintf(reply, sizeof(reply), "you are in room %s", room_name);
+    send_notice(loop, c, reply);
+}
+
+// !stats for the admin: stage histograms of every loop, then each loop's
+// clients. Those belong to other threads, so each loop reports its own.
+void handle_stats(event_loop *loop, client *c) {
+    char line[256];
+    if (!admin_name || strcmp(c->name, admin_name) != 0) {
+        send_notice(loop, c, "!stats is for the admin only");
+        return;
+    }
+    for (int s = 0; s < NUM_STAGES; s++) {
+        stage_hist sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int k = 0; k < num_loops; k++) {
+            const stage_hist *h = &loops[k].stages[s];
+            sum.count += h->count;
+            sum.total_ns += h->total_ns;
+            if (h->max_ns > sum.max_ns) sum.max_ns = h->max_ns;
+            for (int b = 0; b < LAT_BUCKETS; b++) sum.buckets[b] += h->buckets[b];
+        }
+        snprintf(line, sizeof(line), "stage %s: %llu samples, avg %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+                 stage_names[s], (unsigned long long)sum.count, sum.count ? sum.total_ns / 1000.0 / sum.count : 0.0,
+                 hist_percentile(sum.buckets, sum.count, 50, sum.max_ns) / 1000.0,
+                 hist_percentile(sum.buckets, sum.count, 99, sum.max_ns) / 1000.0,
+                 hist_percentile(sum.buckets, sum.count, 99.9, sum.max_ns) / 1000.0, sum.max_ns / 1000.0);
+        send_notice(loop, c, line);
+    }
+    for (int k = 0; k < num_loops; k++) {
+        if (k == loop->id) {
+            stats_send_clients(loop, loop->id, c->fd, c->id);
+            continue;
+        }
+        mail *ml = calloc(1, sizeof(mail));
+        if (!ml) continue;
+        ml->kind = MAIL_STATS;
+        ml->target_loop = loop->id;
+        ml->target_fd = c->fd;
+        ml->target_id = c->id;
+        mail_post(&loops[k], ml);
+    }
+}
+
+// One line per client of this loop, whispered to the admin
+void stats_send_clients(event_loop *loop, int admin_loop, int admin_fd, uint64_t admin_id) {
+    char line[BUFFER_SIZE + 256];
+    int shown = loop->num_active < STATS_MAX_CLIENTS ? loop->num_active : STATS_MAX_CLIENTS;
+    for (int j = 0; j <= shown; j++) {
+        if (j < shown) {
+            client *c = loop->active_clients[j];
+            snprintf(line, sizeof(line), "loop %d %s: in %llu msgs %llu bytes, out %llu msgs %llu bytes, queued %zu bytes (peak %zu), %llu over rate",
+                     loop->id, c->name, (unsigned long long)c->msgs_in, (unsigned long long)c->bytes_in,
+                     (unsigned long long)c->msgs_out, (unsigned long long)c->bytes_out, c->out_bytes, c->peak_queued,
+                     (unsigned long long)c->msgs_limited);
+        } else {
+            snprintf(line, sizeof(line), "loop %d: %d clients, %d not listed", loop->id, loop->num_active,
+                     loop->num_active - shown);
+        }
+        msg_buf *m = msg_new(H3_MSG, "server: ", 8, line, strlen(line));
+        if (!m) return;
+        if (admin_loop == loop->id) deliver_whisper(loop, admin_fd, admin_id, m);
+        else post_mail(&loops[admin_loop], MAIL_WHISPER, m, -1, admin_fd, admin_id);
+        msg_unref(m);
+    }
+}
+
+// Input a throttled client may pile up before its messages are dropped.
+// Only io_uring gets there, epoll stops reading instead.
+size_t rate_backlog(void) {
+    return high_water_mark > H3_HEADER_LEN + H3_MAX_PAYLOAD ? high_water_mark : H3_HEADER_LEN + H3_MAX_PAYLOAD;
+}
+
+// Whether c may send a message of len bytes now; takes the tokens if so.
+// Both the client's buckets and its loop's share of the global ones count.
+rate_verdict rate_check(event_loop *loop, client *c, size_t len) {
+    if (!rate_limited) return RATE_OK;
+    uint64_t now = loop->now_ms;
+    bucket_refill(&c->msg_tokens, &client_msgs, now);
+    bucket_refill(&c->byte_tokens, &client_bytes, now);
+    bucket_refill(&loop->msg_tokens, &loop_msgs, now);
+    bucket_refill(&loop->byte_tokens, &loop_bytes, now);
+    if (bucket_has(&c->msg_tokens, &client_msgs, 1) && bucket_has(&c->byte_tokens, &client_bytes, len) &&
+        bucket_has(&loop->msg_tokens, &loop_msgs, 1) && bucket_has(&loop->byte_tokens, &loop_bytes, len)) {
+        bucket_take(&c->msg_tokens, &client_msgs, 1);
+        bucket_take(&c->byte_tokens, &client_bytes, len);
+        bucket_take(&loop->msg_tokens, &loop_msgs, 1);
+        bucket_take(&loop->byte_tokens, &loop_bytes, len);
+        c->limited = 0;
+        return RATE_OK;
+    }
+
+    if (over_rate == RATE_DELAY && c->in_len < rate_backlog()) {
+        if (!c->throttled) {
+            c->throttled = 1;
+            c->next_throttled = loop->throttled;
+            loop->throttled = c;
+        }
+        return RATE_WAIT;
+    }
+    c->msgs_limited++;
+    if (!c->limited) {
+        c->limited = 1;
+        send_notice(loop, c, "you are over the rate limit, messages are being dropped");
+    }
+    return RATE_DROPPED;
+}
+
+// Runs a command, or fans out chat once the sender's rate allows it.
+// RATE_WAIT leaves the message to the caller, to hand in again later.
+rate_verdict handle_message(event_loop *loop, client *sender, const char *text, size_t len) {
+    int leave = (len == 6 || (len == 7 && text[6] == '\r')) && strncmp(text, "/leave", 6) == 0;
+    int join = len > 6 && strncmp(text, "/join ", 6) == 0;
+    int stats = (len == 6 || (len == 7 && text[6] == '\r')) && strncmp(text, "!stats", 6) == 0;
+
+    // Commands are never rate limited, only chat that fans out
+    if (!leave && !join && !stats) {
+        rate_verdict verdict = rate_check(loop, sender, len);
+        if (verdict != RATE_OK) return verdict;
+    }
+    sender->msgs_in++;
+    if (leave || join) {
+        handle_command(loop, sender, text, len);
+        return RATE_OK;
+    }
+    if (stats) {
+        handle_stats(loop, sender);
+        return RATE_OK;
+    }
+
+    char prefix[BUFFER_SIZE + 2];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s: ", sender->name);
+    if (prefix_len >= (int)sizeof(prefix)) prefix_len = sizeof(prefix) - 1;
+
+    msg_buf *m = msg_new(H3_MSG, prefix, prefix_len, text, len);
+    if (!m) return RATE_OK;
+    uint64_t start = now_ns();
+
+    // Check for Whisper Message
+    const char *space_ptr = memchr(text, ' ', len);
+
+    if (len > 0 && text[0] == '@' && space_ptr != NULL) {
+        int name_len = space_ptr - (text + 1);
+        char target_name[MAX_NAME];
+        memset(target_name, 0, sizeof(target_name));
+        if (name_len >= (int)sizeof(target_name)) name_len = sizeof(target_name) - 1;
+        strncpy(target_name, text + 1, name_len);
+
+        // Find target and send ONLY to them, through its loop's mailbox if it is not ours
+        name_entry target;
+        if (registry_lookup(target_name, &target) == 0) {
+            if (target.node != node_id) peer_route(target.node, target_name, m);
+            else if (target.loop == loop->id) deliver_whisper(loop, target.fd, target.id, m);
+            else post_mail(&loops[target.loop], MAIL_WHISPER, m, -1, target.fd, target.id);
+        }
+    }
+    else {
+        // Normal Message: Broadcast to everyone in the sender's room
+        history_append(sender->room, m);
+        peer_relay(sender->room, m);
+        deliver_broadcast(loop, sender->room, m);
+        for (int k = 0; k < num_loops; k++) {
+            if (k != loop->id) post_mail(&loops[k], MAIL_BROADCAST, m, sender->room, -1, 0);
+        }
+    }
+    stage_record(loop, STAGE_FANOUT, now_ns() - start);
+    msg_unref(m);
+    return RATE_OK;
+}
+
+rate_verdict handle_frame(event_loop *loop, client *c, uint8_t type, const char *payload, size_t len) {
+    if (type == H3_MSG) {
+        return handle_message(loop, c, payload, len);
+    } else if (type == H3_PING) {
+        msg_buf *pong = msg_new(H3_PONG, payload, len, "", 0);
+        if (pong) {
+            send_to_client(loop, c, pong);
+            msg_unref(pong);
+        }
+    }
+    // PONG and a repeated NAME need no answer
+    return RATE_OK;
+}
+
+// Handles every complete message in c->in_buf and keeps the partial tail.
+// Frames and lines may be split across reads or arrive many per read.
+void consume_input(event_loop *loop, client *c) {
+    size_t pos = 0;
+    if (c->peer) {
+        consume_peer_input(loop, c);
+        return;
+    }
+    if (c->state == CONN_AWAITING_NAME) {
+        pos = handle_handshake(loop, c);
+        if (c->state == CONN_AWAITING_NAME) return;
+    }
+    while (!c->closing && pos < c->in_len) {
+        const char *p = c->in_buf + pos;
+        size_t avail = c->in_len - pos;
+        if (c->framed) {
+            if (avail < H3_HEADER_LEN) break;
+            uint32_t len = h3_get_len((const unsigned char *)p);
+            if (len > H3_MAX_PAYLOAD) {
+                printf("client %s sent an oversized frame\n", c->name);
+                close_later(loop, c);
+                return;
+            }
+            if (avail < H3_HEADER_LEN + len) break;
+            if (handle_frame(loop, c, h3_get_type((const unsigned char *)p), p + H3_HEADER_LEN, len) == RATE_WAIT)
+                break;
+            pos += H3_HEADER_LEN + len;
+        } else {
+            // A line that never ends goes out in pieces
+            const char *nl = memchr(p, '\n', avail);
+            if (!nl && avail < H3_MAX_PAYLOAD) break;
+            size_t line = nl ? (size_t)(nl - p) : H3_MAX_PAYLOAD;
+            if (handle_message(loop, c, p, line) == RATE_WAIT) break;
+            pos += nl ? line + 1 : line;
+        }
+    }
+    memmove(c->in_buf, c->in_buf + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+// consume_input() under STAGE_PARSE, less the fan-out it triggered, which
+// is recorded as STAGE_FANOUT already
+void parse_input(event_loop *loop, client *c) {
+    uint64_t fanout = loop->stages[STAGE_FANOUT].total_ns;
+    uint64_t start = now_ns();
+    consume_input(loop, c);
+    uint64_t spent = now_ns() - start;
+    fanout = loop->stages[STAGE_FANOUT].total_ns - fanout;
+    stage_record(loop, STAGE_PARSE, spent > fanout ? spent - fanout : 0);
+}
+
+// Makes room for more input. Room for one whole frame at most, consume_input
+// never leaves more than that behind, unless rate limits hold it back.
+int grow_input(client *c) {
+    if (c->in_len < c->in_cap) return 0;
+    size_t new_cap = c->in_cap ? c->in_cap * 2 : HANDSHAKE_MAX;
+    size_t max_cap = H3_HEADER_LEN + (c->peer ? H3_PEER_MAX_PAYLOAD : H3_MAX_PAYLOAD);
+    if (c->throttled) max_cap = rate_backlog();
+    if (new_cap > max_cap) new_cap = max_cap;
+    char *grown = realloc(c->in_buf, new_cap);
+    if (!grown) return -1;
+    c->in_buf = grown;
+    c->in_cap = new_cap;
+    return 0;
+}
+
+// --- CASE 2: INCOMING DATA FROM CLIENT ---
+// Edge triggered, so keep reading until the socket says EAGAIN
+void handle_client(event_loop *loop, client *c) {
+    while (!c->closing && !c->throttled) {
+        if (grow_input(c) < 0) {
+            close_later(loop, c);
+            return;
+        }
+        uint64_t start = now_ns();
+        ssize_t n = read(c->fd, c->in_buf + c->in_len, c->in_cap - c->in_len);
+        stage_record(loop, STAGE_READ, now_ns() - start);
+
+        if (n > 0) {
+            c->in_len += n;
+            c->bytes_in += n;
+            c->last_active = loop->now_ms;
+            parse_input(loop, c);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // --- DISCONNECTION HANDLING ---
+        close_later(loop, c);
+        return;
+    }
+}
+
+// Retries every throttled client, once per wakeup. Under epoll their
+// sockets were left unread, so read on if the backlog cleared.
+void rate_resume(event_loop *loop) {
+    client *c = loop->throttled;
+    loop->throttled = NULL;
+    while (c) {
+        client *next = c->next_throttled;
+        c->throttled = 0;
+        if (!c->closing) {
+            parse_input(loop, c);
+            if (!c->throttled && !loop->uring) handle_client(loop, c);
+        }
+        c = next;
+    }
+}
+
+// --- IO_URING BACKEND ---
+// Optional (--io=uring): multishot accept, multishot recv into a provided
+// buffer ring and one sendmsg per client with output, all submitted with a
+// single io_uring_enter per batch. Talks to the kernel through raw
+// syscalls, so liburing is not needed. Message parsing, fan-out and the
+// output queues are shared with the epoll loop.
+#ifdef HAVE_IO_URING
+// user_data is a client pointer (or 0) with the request kind in the low bits
+enum { URING_ACCEPT = 1, URING_WAKE, URING_RECV, URING_SEND, URING_PROBE, URING_TICK };
+#define URING_TAG_MASK 7
+
+int uring_enter(io_ring *r, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Next free submission entry, flushing the queue to the kernel when it is full
+struct io_uring_sqe *uring_sqe(io_ring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    while (r->sq_local_tail - head >= r->sq_entries) {
+        int n = uring_enter(r, r->to_submit, 0, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) error("Error in io_uring_enter");
+        if (n > 0) r->to_submit -= n;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+// Gives buffer bid back to the kernel
+void uring_recycle(io_ring *r, unsigned bid) {
+    struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->buf_mem + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_arm_recv(io_ring *r, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+}
+
+void uring_arm_accept(event_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // Blocking sockets: io_uring then waits for readiness itself instead of
+    // failing the request with -EAGAIN
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+void uring_arm_wake(event_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->ring.wake_count;
+    sqe->len = sizeof(loop->ring.wake_count);
+    sqe->user_data = URING_WAKE;
+}
+
+// Multishot recv with buffer selection needs Linux 6.0. Older kernels
+// accept the ring but fail the request, so try one on a socketpair.
+int uring_probe(io_ring *r) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    uring_arm_recv(r, sv[0], URING_PROBE);
+    int ok = write(sv[1], "x", 1) == 1;
+    close(sv[1]);
+
+    // Expect the byte, then end-of-stream once the peer is closed
+    int got_byte = 0, done = 0;
+    while (ok && !done) {
+        if (uring_enter(r, r->to_submit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) break;
+        r->to_submit = 0;
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                got_byte = 1;
+                uring_recycle(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) done = 1;
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(sv[0]);
+    return got_byte && done ? 0 : -1;
+}
+
+void uring_close(io_ring *r) {
+    if (r->fd >= 0) close(r->fd);
+    free(r->buf_mem);
+    r->fd = -1;
+}
+
+// Sets up the rings and the buffer ring. Returns -1 if the kernel cannot
+// run this backend, so the caller can fall back to epoll.
+int uring_init(event_loop *loop) {
+    io_ring *r = &loop->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        uring_close(r);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        uring_close(r);
+        return -1;
+    }
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->sqes = sqes;
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // Provided buffers for multishot recv, registered as buffer group 0
+    r->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buf_mem = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (r->buf_ring == MAP_FAILED || !r->buf_mem) {
+        uring_close(r);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_close(r);
+        return -1;
+    }
+    for (unsigned b = 0; b < URING_BUFS; b++) uring_recycle(r, b);
+
+    if (uring_probe(r) < 0) {
+        uring_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+// One sendmsg per dirty client, covering up to IOV_BATCH queued messages
+void uring_submit_sends(event_loop *loop) {
+    while (loop->dirty) {
+        client *c = loop->dirty;
+        loop->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (c->send_busy || c->closing || c->out_count == 0) continue;
+        uint64_t start = now_ns();
+        if (!c->send) {
+            c->send = calloc(1, sizeof(uring_send));
+            if (!c->send) {
+                close_later(loop, c);
+                continue;
+            }
+        }
+        int cnt = c->out_count < IOV_BATCH ? c->out_count : IOV_BATCH;
+        for (int k = 0; k < cnt; k++) {
+            msg_buf *m = c->out_q[(c->out_head + k) % c->out_cap];
+            c->send->iov[k].iov_base = (char *)msg_data(c->framed, m);
+            c->send->iov[k].iov_len = msg_size(c->framed, m);
+        }
+        c->send->iov[0].iov_base = (char *)c->send->iov[0].iov_base + c->out_off;
+        c->send->iov[0].iov_len -= c->out_off;
+        c->send->msg.msg_iov = c->send->iov;
+        c->send->msg.msg_iovlen = cnt;
+
+        struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&c->send->msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uint64_t)(uintptr_t)c | URING_SEND;
+        c->send_busy = 1;
+        c->inflight++;
+        // The send itself is the kernel's, STAGE_FLUSH is preparing it
+        stage_record(loop, STAGE_FLUSH, now_ns() - start);
+    }
+}
+
+void uring_accepted(event_loop *loop, int fd) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
+    getpeername(fd, (struct sockaddr *) &client_addr, &client_len);
+    client *c = add_client(loop, fd, client_addr.sin_addr);
+    if (!c) {
+        close(fd);
+        return;
+    }
+    uring_arm_recv(&loop->ring, fd, (uint64_t)(uintptr_t)c | URING_RECV);
+    c->inflight++;
+}
+
+void uring_received(event_loop *loop, client *c, struct io_uring_cqe *cqe) {
+    io_ring *r = &loop->ring;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) c->inflight--;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = r->buf_mem + (size_t)bid * URING_BUF_SIZE;
+        size_t n = cqe->res;
+        c->bytes_in += n;
+        c->last_active = loop->now_ms;
+        // Same parser as the epoll path, fed from the kernel-chosen buffer
+        while (n > 0 && !c->closing) {
+            if (grow_input(c) < 0) {
+                close_later(loop, c);
+                break;
+            }
+            size_t chunk = c->in_cap - c->in_len;
+            if (chunk > n) chunk = n;
+            // The kernel already did the read, STAGE_READ is the copy out
+            uint64_t start = now_ns();
+            memcpy(c->in_buf + c->in_len, data, chunk);
+            stage_record(loop, STAGE_READ, now_ns() - start);
+            c->in_len += chunk;
+            data += chunk;
+            n -= chunk;
+            parse_input(loop, c);
+        }
+        uring_recycle(r, bid);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+    // A removed client keeps its fd until freed, so the table slot tells
+    if (loop->clients[c->fd] != c) {
+        if (c->inflight == 0) free_client(c);
+        return;
+    }
+    // Multishot recv stops when the buffer ring runs dry; just re-arm it
+    if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+        uring_arm_recv(r, c->fd, (uint64_t)(uintptr_t)c | URING_RECV);
+        c->inflight++;
+        return;
+    }
+    close_later(loop, c);
+}
+
+void uring_sent(event_loop *loop, client *c, int res) {
+    c->inflight--;
+    c->send_busy = 0;
+    if (loop->clients[c->fd] != c) {
+        // Already removed, this was the last thing keeping it alive
+        if (c->inflight == 0) free_client(c);
+        return;
+    }
+    if (res > 0) {
+        consume_output(c, res);
+        if (c->out_count > 0) mark_dirty(loop, c);
+    } else if (res != -EINTR && res != -EAGAIN) {
+        close_later(loop, c);
+    } else {
+        mark_dirty(loop, c);
+    }
+}
+
+// Completes after one timer tick, so the wheel turns on an idle loop too
+void uring_arm_tick(event_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    loop->ring.tick.tv_sec = 0;
+    loop->ring.tick.tv_nsec = TIMER_TICK_MS * 1000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->ring.tick;
+    sqe->len = 1; // one timespec, and off 0: a plain timer
+    sqe->user_data = URING_TICK;
+}
+
+void *run_uring_loop(event_loop *loop) {
+    io_ring *r = &loop->ring;
+    uring_arm_accept(loop);
+    uring_arm_wake(loop);
+    if (idle_timeout_ms || (rate_limited && over_rate == RATE_DELAY)) uring_arm_tick(loop);
+
+    // Main Server Loop: submit everything queued and wait, in one syscall
+    while (1) {
+        uring_submit_sends(loop);
+        int n = uring_enter(r, r->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            error("Error in io_uring_enter");
+        }
+        r->to_submit -= n;
+        loop->now_ms = now_ns() / 1000000;
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            head++;
+            // Free the slot before handling, handlers may submit more work
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+            client *c = (client *)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_TAG_MASK);
+            switch (cqe.user_data & URING_TAG_MASK) {
+            case URING_ACCEPT:
+                if (cqe.res >= 0) uring_accepted(loop, cqe.res);
+                else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED)
+                    fprintf(stderr, "Accept error: %s\n", strerror(-cqe.res));
+                if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm_accept(loop);
+                break;
+            case URING_WAKE:
+                handle_mail(loop);
+                uring_arm_wake(loop);
+                break;
+            case URING_RECV:
+                uring_received(loop, c, &cqe);
+                break;
+            case URING_SEND:
+                uring_sent(loop, c, cqe.res);
+                break;
+            case URING_TICK:
+                uring_arm_tick(loop);
+                break;
+            }
+        }
+        timers_run(loop);
+        rate_resume(loop);
+        close_pending(loop);
+    }
+    return NULL;
+}
+#endif
+
+// --- EVENT LOOP ---
+int create_listener(int port) {
     // Create the server socket (TCP)
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) error("Error opening socket");
 
     // Allow immediate reuse of the port
     int opt = 1;// Set socket option SO_REUSEADDR. This allows to restart the server immediately after it crashes or is closed
     setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Every loop binds its own socket to the port, the kernel spreads new connections
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        error("Error setting SO_REUSEPORT");
 
     // Bind the socket
+    struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY; 
+    server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
 
-    if (bind(server_sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) 
+    if (bind(server_sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0)
         error("Error on binding");
 
-    // Listen for incoming connections
-    listen(server_sock, 5);
-    printf("Server listening on port %d...\n", port);
+    // Listen for incoming connections; never block in accept, the loop drains it until EAGAIN
+    if (set_nonblocking(server_sock) < 0) error("Error setting listener non-blocking");
+    if (listen(server_sock, listen_backlog) < 0) error("Error on listen");
+    return server_sock;
+}
+
+void init_loop(event_loop *loop, int id, int port) {
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    loop->now_ms = now_ns() / 1000000;
+    loop->wheel.now = loop->now_ms / TIMER_TICK_MS;
+    bucket_init(&loop->msg_tokens, &loop_msgs, loop->now_ms);
+    bucket_init(&loop->byte_tokens, &loop_bytes, loop->now_ms);
+    loop->listen_fd = create_listener(port);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) error("Error creating eventfd");
+
+#ifdef HAVE_IO_URING
+    // fed_loop (id -1) always runs on epoll
+    if (want_uring && id >= 0) {
+        if (uring_init(loop) == 0) {
+            loop->uring = 1;
+            return;
+        }
+        if (id == 0) fprintf(stderr, "io_uring not supported here, using epoll\n");
+    }
+#endif
+
+    // Setup for epoll: cost per wakeup depends on ready fds, not on the highest fd
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) error("Error creating epoll instance");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->listen_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0)
+        error("Error registering listener");
+    ev.data.fd = loop->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0)
+        error("Error registering eventfd");
+}
+
+void *run_loop(void *arg) {
+    event_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+#ifdef HAVE_IO_URING
+    if (loop->uring) return run_uring_loop(loop);
+#endif
+
+    // Main Server Loop, waking up every tick when timers are on
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, idle_timeout_ms || loop->throttled ? TIMER_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("Error in epoll_wait");
+        }
+        loop->now_ms = now_ns() / 1000000;
 
-    // Setup for select()
-    fd_set readfds;         // The master set containing all file descriptors to monitor
-    fd_set temp_fds;        // A temporary set because select() modifies the set passed to it
-    int max_fd;             // A temporary set because select() modifies the set passed to it
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->listen_fd) {
+                accept_clients(loop);
+            } else if (fd == loop->wake_fd) {
+                handle_mail(loop);
+            } else if (fd < loop->clients_size && loop->clients[fd] != NULL) {
+                client *c = loop->clients[fd];
+                if (events[i].events & EPOLLOUT) flush_client(loop, c);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) handle_client(loop, c);
+            }
+        }
+        timers_run(loop);
+        rate_resume(loop);
+        close_pending(loop);
+    }
+    return NULL;
+}
 
-    FD_ZERO(&readfds);      // Initialize the master set to empty
-    FD_SET(server_sock, &readfds); // Add the main listener socket to the set
-    max_fd = server_sock;
+// The federation thread. Links go through the same client code as chat
+// connections, with consume_peer_input() in place of the chat protocol.
+void *run_fed_loop(void *arg) {
+    event_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t last_dial = 0;
 
-    // Main Server Loop
     while (1) {
-        temp_fds = readfds; 
-
-        if (select(max_fd + 1, &temp_fds, NULL, NULL, NULL) < 0) 
-            error("Error in select");
-
-        // Iterate through all FDs
-        for (int i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, &temp_fds)) {
-                
-                // --- CASE 1: NEW CONNECTION ---
-                if (i == server_sock) {
-                    client_len = sizeof(client_addr);
-                    new_sock = accept(server_sock, (struct sockaddr *) &client_addr, &client_len);
-                    
-                    if (new_sock < 0) {
-                        perror("Accept error");
-                    } else if (new_sock >= MAX_FD) {
-                        close(new_sock);
-                    } else {
-                        FD_SET(new_sock, &readfds);
-                        if (new_sock > max_fd) max_fd = new_sock;
-
-                        // Handshake
-                        char name_buf[BUFFER_SIZE];
-                        memset(name_buf, 0, BUFFER_SIZE);
-                        int len = read(new_sock, name_buf, BUFFER_SIZE - 1);
-                        
-                        if (len > 0) {
-                            name_buf[strcspn(name_buf, "\r\n")] = 0; 
-                            client_names[new_sock] = strdup(name_buf); 
-                            
-                            printf("client %s connected from %s\n", 
-                                   client_names[new_sock], inet_ntoa(client_addr.sin_addr));
-                        } else {
-                            close(new_sock);
-                            FD_CLR(new_sock, &readfds);
-                        }
-                    }
-                } 
-                // --- CASE 2: INCOMING DATA FROM CLIENT ---
-                else {
-                    char buffer[BUFFER_SIZE];
-                    memset(buffer, 0, BUFFER_SIZE);
-                    int n = read(i, buffer, BUFFER_SIZE - 1);
-                    
-                    // --- DISCONNECTION HANDLING ---
-                    if (n <= 0) {
-                        if (client_names[i] != NULL) {
-                            printf("client %s disconnected\n", client_names[i]);
-                            free(client_names[i]); 
-                            client_names[i] = NULL;
-                        }
-                        close(i);            
-                        FD_CLR(i, &readfds); 
-                    } 
-                    // --- MESSAGE HANDLING ---
-                    else {
-                        char formatted_msg[BUFFER_SIZE + 50];
-                        memset(formatted_msg, 0, sizeof(formatted_msg));
-                        sprintf(formatted_msg, "%s: %s", client_names[i], buffer);
-
-                        // Check for Whisper Message
-                        char *space_ptr = strchr(buffer, ' ');
-                        
-                        if (buffer[0] == '@' && space_ptr != NULL) {
-                            int name_len = space_ptr - (buffer + 1);
-                            char target_name[100];
-                            memset(target_name, 0, sizeof(target_name));
-                            strncpy(target_name, buffer + 1, name_len);
-
-                            // Find target and send ONLY to them
-                            for (int j = 0; j <= max_fd; j++) {
-                                if (client_names[j] != NULL && strcmp(client_names[j], target_name) == 0) {
-                                    write(j, formatted_msg, strlen(formatted_msg));
-                                    break; 
-                                }
-                            }
-                        } 
-                        else {
-                            // Normal Message: Broadcast to ALL
-                            for (int j = 0; j <= max_fd; j++) {
-                                if (FD_ISSET(j, &readfds) && j != server_sock) {
-                                    write(j, formatted_msg, strlen(formatted_msg));
-                                }
-                            }
-                        }
-                    }
-                }
+        if (now_ns() - last_dial >= PEER_RETRY_MS * 1000000ULL) {
+            peer_redial(loop);
+            last_dial = now_ns();
+        }
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, PEER_RETRY_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("Error in epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->listen_fd) {
+                accept_clients(loop);
+            } else if (fd == loop->wake_fd) {
+                handle_mail(loop);
+            } else if (fd < loop->clients_size && loop->clients[fd] != NULL) {
+                client *c = loop->clients[fd];
+                if (c->state == CONN_CONNECTING) peer_connected(loop, c);
+                else if (events[i].events & EPOLLOUT) flush_client(loop, c);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) handle_client(loop, c);
             }
         }
+        peer_flush(loop);
+        close_pending(loop);
+    }
+    return NULL;
+}
+
+// "ID@HOST:PORT"
+int parse_peer(const char *spec) {
+    char host[256];
+    int node, port;
+    if (num_peer_confs == MAX_NODES) return -1;
+    if (sscanf(spec, "%d@%255[^:]:%d", &node, host, &port) != 3) return -1;
+    if (node < 0 || node >= MAX_NODES || port < 1 || port > 65535) return -1;
+    struct hostent *he = gethostbyname(host);
+    if (!he || he->h_addrtype != AF_INET) return -1;
+
+    peer_conf *conf = &peer_confs[num_peer_confs++];
+    memset(conf, 0, sizeof(*conf));
+    conf->node = node;
+    conf->addr.sin_family = AF_INET;
+    conf->addr.sin_port = htons(port);
+    memcpy(&conf->addr.sin_addr, he->h_addr_list[0], sizeof(conf->addr.sin_addr));
+    return 0;
+}
+
+// Optional flags after the port, "--name=value"
+int parse_option(const char *opt) {
+    if (strncmp(opt, "--threads=", 10) == 0) {
+        num_loops = atoi(opt + 10);
+        if (num_loops < 1 || num_loops > MAX_THREADS) return -1;
+    } else if (strncmp(opt, "--hwm=", 6) == 0) {
+        long long hwm = atoll(opt + 6);
+        if (hwm < 1) return -1;
+        high_water_mark = hwm;
+    } else if (strncmp(opt, "--backlog=", 10) == 0) {
+        listen_backlog = atoi(opt + 10);
+        if (listen_backlog < 1) return -1;
+    } else if (strcmp(opt, "--io=epoll") == 0) {
+        want_uring = 0;
+    } else if (strcmp(opt, "--io=uring") == 0) {
+        want_uring = 1;
+    } else if (strcmp(opt, "--slow-policy=drop") == 0) {
+        slow_clients = SLOW_DROP;
+    } else if (strcmp(opt, "--slow-policy=evict") == 0) {
+        slow_clients = SLOW_EVICT;
+    } else if (strncmp(opt, "--idle-timeout=", 15) == 0) {
+        double sec = atof(opt + 15);
+        if (sec <= 0) return -1;
+        idle_timeout_ms = sec * 1000;
+    } else if (strncmp(opt, "--heartbeat=", 12) == 0) {
+        double sec = atof(opt + 12);
+        if (sec <= 0) return -1;
+        heartbeat_ms = sec * 1000;
+    } else if (strncmp(opt, "--rate-msgs=", 12) == 0) {
+        client_msgs.rate = atof(opt + 12);
+        if (client_msgs.rate <= 0) return -1;
+    } else if (strncmp(opt, "--rate-bytes=", 13) == 0) {
+        client_bytes.rate = atof(opt + 13);
+        if (client_bytes.rate <= 0) return -1;
+    } else if (strncmp(opt, "--global-rate-msgs=", 19) == 0) {
+        loop_msgs.rate = atof(opt + 19);
+        if (loop_msgs.rate <= 0) return -1;
+    } else if (strncmp(opt, "--global-rate-bytes=", 20) == 0) {
+        loop_bytes.rate = atof(opt + 20);
+        if (loop_bytes.rate <= 0) return -1;
+    } else if (strncmp(opt, "--rate-burst=", 13) == 0) {
+        rate_burst_sec = atof(opt + 13);
+        if (rate_burst_sec <= 0) return -1;
+    } else if (strcmp(opt, "--rate-policy=drop") == 0) {
+        over_rate = RATE_DROP;
+    } else if (strcmp(opt, "--rate-policy=delay") == 0) {
+        over_rate = RATE_DELAY;
+    } else if (strncmp(opt, "--admin=", 8) == 0) {
+        admin_name = opt + 8;
+        if (admin_name[0] == 0) return -1;
+    } else if (strncmp(opt, "--node-id=", 10) == 0) {
+        node_id = atoi(opt + 10);
+        if (node_id < 0 || node_id >= MAX_NODES) return -1;
+    } else if (strncmp(opt, "--peer-port=", 12) == 0) {
+        peer_port = atoi(opt + 12);
+        if (peer_port < 1 || peer_port > 65535) return -1;
+    } else if (strncmp(opt, "--peer=", 7) == 0) {
+        return parse_peer(opt + 7);
+    } else if (strncmp(opt, "--history=", 10) == 0) {
+        history_path = opt + 10;
+        if (history_path[0] == 0) return -1;
+    } else if (strncmp(opt, "--history-bytes=", 16) == 0) {
+        long long bytes = atoll(opt + 16);
+        if (bytes < 2 * (H3_MAX_PAYLOAD + 64)) return -1;
+        history_bytes = bytes;
+    } else if (strncmp(opt, "--history-replay=", 17) == 0) {
+        history_replay = atoi(opt + 17);
+        if (history_replay < 0 || history_replay > HISTORY_MAX_REPLAY) return -1;
+    } else {
+        return -1;
     }
-    close(server_sock);
     return 0;
-}
\ No newline at end of file
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <port> [options]\n", prog);
+    fprintf(stderr, "  --threads=N                 event loop threads, each with its own SO_REUSEPORT socket (default 1)\n");
+    fprintf(stderr, "  --hwm=BYTES                 output queued per client before it counts as slow (default %d)\n", DEFAULT_HWM);
+    fprintf(stderr, "  --slow-policy=drop|evict    drop messages for slow clients, or disconnect them (default drop)\n");
+    fprintf(stderr, "  --backlog=N                 listen backlog of each socket (default SOMAXCONN)\n");
+    fprintf(stderr, "  --io=epoll|uring            socket I/O backend, uring falls back to epoll if unsupported (default epoll)\n");
+    fprintf(stderr, "  --history=FILE              keep broadcasts in an mmap'd ring in FILE, kept across restarts\n");
+    fprintf(stderr, "  --history-bytes=BYTES       size of that ring (default %d)\n", DEFAULT_HISTORY_BYTES);
+    fprintf(stderr, "  --history-replay=N          latest lobby messages sent to a new client (default %d, max %d)\n",
+            DEFAULT_HISTORY_REPLAY, HISTORY_MAX_REPLAY);
+    fprintf(stderr, "  --idle-timeout=SEC          close connections that send nothing for SEC seconds\n");
+    fprintf(stderr, "  --heartbeat=SEC             PING framed clients idle for SEC seconds (idle timeout defaults to 3x)\n");
+    fprintf(stderr, "  --rate-msgs=N               messages per second each client may send\n");
+    fprintf(stderr, "  --rate-bytes=N              bytes per second each client may send\n");
+    fprintf(stderr, "  --global-rate-msgs=N        messages per second for the whole server, split evenly between threads\n");
+    fprintf(stderr, "  --global-rate-bytes=N       bytes per second for the whole server, split evenly between threads\n");
+    fprintf(stderr, "  --rate-burst=SEC            seconds of rate a client may save up and send at once (default 1)\n");
+    fprintf(stderr, "  --rate-policy=drop|delay    drop messages over the rate, or stop reading until they fit (default drop)\n");
+    fprintf(stderr, "  --admin=NAME                the client allowed to send !stats\n");
+    fprintf(stderr, "  --node-id=N                 this server's id in a federation, 0..%d (default 0)\n", MAX_NODES - 1);
+    fprintf(stderr, "  --peer-port=PORT            accept links from other servers on PORT, turns federation on\n");
+    fprintf(stderr, "  --peer=ID@HOST:PORT         another server and its peer port, repeat for each; the lower id dials\n");
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, NULL); // Disable output buffering
+    signal(SIGPIPE, SIG_IGN); // A peer that went away shows up as EPIPE on write
+    // Check command line arguments: hw3server port
+    if (argc < 2) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    for (int i = 2; i < argc; i++) {
+        if (parse_option(argv[i]) != 0) {
+            fprintf(stderr, "Error: bad option %s\n", argv[i]);
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    int port = atoi(argv[1]);// Convert the port argument from string to integer
+    // Heartbeats are for noticing dead peers, so they always come with a timeout
+    if (heartbeat_ms && !idle_timeout_ms) idle_timeout_ms = 3 * heartbeat_ms;
+    // Each loop enforces its share of the global limits on its own, no lock
+    loop_msgs.rate /= num_loops;
+    loop_bytes.rate /= num_loops;
+    rate_limit_setup(&client_msgs);
+    rate_limit_setup(&client_bytes);
+    rate_limit_setup(&loop_msgs);
+    rate_limit_setup(&loop_bytes);
+    if (num_peer_confs > 0 && peer_port == 0) {
+        fprintf(stderr, "Error: --peer needs --peer-port\n");
+        exit(1);
+    }
+    for (int k = 0; k < num_peer_confs; k++) {
+        if (peer_confs[k].node == node_id) {
+            fprintf(stderr, "Error: peer %d has this server's node id\n", node_id);
+            exit(1);
+        }
+    }
+
+    room_intern("lobby"); // LOBBY
+    if (history_path) history_open();
+    loops = calloc(num_loops, sizeof(event_loop));
+    if (!loops) error("Error allocating event loops");
+    for (int k = 0; k < num_loops; k++) init_loop(&loops[k], k, port);
+    printf("Server listening on port %d...\n", port);
+    if (peer_port) {
+        fed_loop = calloc(1, sizeof(event_loop));
+        if (!fed_loop) error("Error allocating federation loop");
+        init_loop(fed_loop, -1, peer_port);
+        if (pthread_create(&fed_loop->thread, NULL, run_fed_loop, fed_loop) != 0)
+            error("Error creating federation thread");
+        printf("Node %d linking to peers on port %d...\n", node_id, peer_port);
+    }
+
+    // Loop 0 runs on the main thread
+    for (int k = 1; k < num_loops; k++) {
+        if (pthread_create(&loops[k].thread, NULL, run_loop, &loops[k]) != 0)
+            error("Error creating event loop thread");
+    }
+    run_loop(&loops[0]);
+    return 0;
+}